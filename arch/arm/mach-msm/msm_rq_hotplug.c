@@ -0,0 +1,238 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 and
+ * only version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+/*
+ * Qualcomm MSM run queue based CPU hotplug
+ *
+ * Every sample_ms the run queue average collected by msm_rq_stats, the
+ * load of the online cores and the frequency of cpu0 decide whether to
+ * bring one more core online or take one offline.  A decision has to
+ * hold for up_delay_ms (resp. down_delay_ms) before it is acted on.
+ *
+ * The tunables are in /sys/module/msm_rq_hotplug/parameters/.
+ */
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/cpu.h>
+#include <linux/cpufreq.h>
+#include <linux/jiffies.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/tick.h>
+#include <linux/workqueue.h>
+#include <linux/rq_stats.h>
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/rq_hotplug.h>
+
+/* sampling period */
+static unsigned int sample_ms = 50;
+module_param(sample_ms, uint, S_IRUGO | S_IWUSR);
+
+/*
+ * Run queue thresholds, in tenths of a task per online core: go up when
+ * the average reaches up_rq for every online core, go down when the
+ * cores left would see less than down_rq each.
+ */
+static unsigned int up_rq = 19;
+module_param(up_rq, uint, S_IRUGO | S_IWUSR);
+static unsigned int down_rq = 11;
+module_param(down_rq, uint, S_IRUGO | S_IWUSR);
+
+/*
+ * Load thresholds, in percent of one core: go up when every online core
+ * is this busy and cpu0 runs at its maximum frequency (or up_freq kHz
+ * if set), go down when the remaining cores would be below down_load.
+ */
+static unsigned int up_load = 90;
+module_param(up_load, uint, S_IRUGO | S_IWUSR);
+static unsigned int up_freq;
+module_param(up_freq, uint, S_IRUGO | S_IWUSR);
+static unsigned int down_load = 60;
+module_param(down_load, uint, S_IRUGO | S_IWUSR);
+
+/* how long a decision has to hold before it is acted on */
+static unsigned int up_delay_ms = 100;
+module_param(up_delay_ms, uint, S_IRUGO | S_IWUSR);
+static unsigned int down_delay_ms = 500;
+module_param(down_delay_ms, uint, S_IRUGO | S_IWUSR);
+
+static unsigned int min_cpus = 1;
+module_param(min_cpus, uint, S_IRUGO | S_IWUSR);
+static unsigned int max_cpus = NR_CPUS;
+module_param(max_cpus, uint, S_IRUGO | S_IWUSR);
+
+struct rq_hotplug_cpu {
+	u64 prev_idle;
+	u64 prev_wall;
+	bool valid;
+};
+
+static DEFINE_PER_CPU(struct rq_hotplug_cpu, rq_hotplug_cpu);
+
+static struct workqueue_struct *rq_hotplug_wq;
+static struct delayed_work rq_hotplug_work;
+static DEFINE_MUTEX(rq_hotplug_lock);
+static unsigned long up_since;
+static unsigned long down_since;
+
+static int enabled = 1;
+static int set_enabled(const char *val, struct kernel_param *kp);
+module_param_call(enabled, set_enabled, param_get_int, &enabled, 0644);
+
+/* sum of the loads of the online cores since the previous sample */
+static unsigned int rq_hotplug_load(void)
+{
+	unsigned int cpu, total = 0;
+
+	for_each_possible_cpu(cpu) {
+		struct rq_hotplug_cpu *pcpu = &per_cpu(rq_hotplug_cpu, cpu);
+		u64 idle, wall;
+		unsigned int delta_idle, delta_wall;
+
+		if (!cpu_online(cpu)) {
+			pcpu->valid = false;
+			continue;
+		}
+
+		idle = get_cpu_idle_time_us(cpu, &wall);
+		delta_idle = (unsigned int)(idle - pcpu->prev_idle);
+		delta_wall = (unsigned int)(wall - pcpu->prev_wall);
+		if (pcpu->valid && delta_wall && delta_idle <= delta_wall)
+			total += 100 * (delta_wall - delta_idle) / delta_wall;
+
+		pcpu->prev_idle = idle;
+		pcpu->prev_wall = wall;
+		pcpu->valid = true;
+	}
+
+	return total;
+}
+
+/* true once cond has held for delay_ms, tracked in *since */
+static bool rq_hotplug_held(bool cond, unsigned long *since,
+			    unsigned int delay_ms)
+{
+	if (!cond) {
+		*since = 0;
+		return false;
+	}
+	if (!*since)
+		*since = jiffies;
+	return time_after_eq(jiffies, *since + msecs_to_jiffies(delay_ms));
+}
+
+static void rq_hotplug_work_fn(struct work_struct *work)
+{
+	struct cpufreq_policy *policy;
+	unsigned int rq_avg, load, online, cpu;
+	unsigned int freq = 0, freq_max = 0;
+	bool up, down;
+	int action = 0;
+
+	mutex_lock(&rq_hotplug_lock);
+	if (!enabled)
+		goto out;
+
+	rq_avg = msm_rq_stats_read_avg();
+	load = rq_hotplug_load();
+	online = num_online_cpus();
+
+	policy = cpufreq_cpu_get(0);
+	if (policy) {
+		freq = policy->cur;
+		freq_max = up_freq ? up_freq : policy->max;
+		cpufreq_cpu_put(policy);
+	}
+
+	up = online < min(max_cpus, num_possible_cpus()) &&
+		(rq_avg >= up_rq * online ||
+		 (load >= up_load * online && freq >= freq_max));
+	down = online > max(min_cpus, 1U) &&
+		rq_avg < down_rq * (online - 1) &&
+		load < down_load * (online - 1);
+
+	if (rq_hotplug_held(up, &up_since, up_delay_ms)) {
+		cpu = cpumask_next_zero(0, cpu_online_mask);
+		if (cpu < nr_cpu_ids && !cpu_up(cpu))
+			action = 1;
+		up_since = 0;
+	} else if (rq_hotplug_held(down, &down_since, down_delay_ms)) {
+		/* the last online core other than cpu0 */
+		for (cpu = nr_cpu_ids - 1; cpu > 0; cpu--)
+			if (cpu_online(cpu))
+				break;
+		if (cpu > 0 && !cpu_down(cpu))
+			action = -1;
+		down_since = 0;
+	}
+
+	trace_rq_hotplug_decision(rq_avg, load, freq, online, action);
+
+	queue_delayed_work(rq_hotplug_wq, &rq_hotplug_work,
+			   msecs_to_jiffies(sample_ms));
+out:
+	mutex_unlock(&rq_hotplug_lock);
+}
+
+static void rq_hotplug_start(void)
+{
+	up_since = 0;
+	down_since = 0;
+	/* start a new run queue averaging period */
+	msm_rq_stats_read_avg();
+	queue_delayed_work(rq_hotplug_wq, &rq_hotplug_work,
+			   msecs_to_jiffies(sample_ms));
+}
+
+static int set_enabled(const char *val, struct kernel_param *kp)
+{
+	int ret;
+	int old;
+
+	if (!rq_hotplug_wq)
+		return param_set_int(val, kp);
+
+	/*
+	 * Disabling only stops the next sample from queueing another one,
+	 * so re-enabling before it runs simply carries on sampling.
+	 */
+	mutex_lock(&rq_hotplug_lock);
+	old = enabled;
+	ret = param_set_int(val, kp);
+	if (!ret && enabled && !old)
+		rq_hotplug_start();
+	mutex_unlock(&rq_hotplug_lock);
+
+	return ret;
+}
+
+static int __init msm_rq_hotplug_init(void)
+{
+	if (!rq_info.init) {
+		pr_err("%s: run queue stats not available\n", __func__);
+		return -ENODEV;
+	}
+
+	rq_hotplug_wq = create_freezable_workqueue("rq_hotplug");
+	if (!rq_hotplug_wq)
+		return -ENOMEM;
+	INIT_DELAYED_WORK_DEFERRABLE(&rq_hotplug_work, rq_hotplug_work_fn);
+
+	mutex_lock(&rq_hotplug_lock);
+	if (enabled)
+		rq_hotplug_start();
+	mutex_unlock(&rq_hotplug_lock);
+
+	return 0;
+}
+late_initcall(msm_rq_hotplug_init);
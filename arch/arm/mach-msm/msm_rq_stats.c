@@ -47,8 +47,7 @@ static void def_work_fn(struct work_struct *work)
 		sysfs_notify(rq_info.kobj, NULL, "def_timer_ms");
 }
 
-static ssize_t show_run_queue_avg(struct kobject *kobj,
-		struct kobj_attribute *attr, char *buf)
+unsigned int msm_rq_stats_read_avg(void)
 {
 	unsigned int val = 0;
 	unsigned long flags = 0;
@@ -59,6 +58,14 @@ static ssize_t show_run_queue_avg(struct kobject *kobj,
 	rq_info.rq_avg = 0;
 	spin_unlock_irqrestore(&rq_lock, flags);
 
+	return val;
+}
+
+static ssize_t show_run_queue_avg(struct kobject *kobj,
+		struct kobj_attribute *attr, char *buf)
+{
+	unsigned int val = msm_rq_stats_read_avg();
+
 	return snprintf(buf, PAGE_SIZE, "%d.%d\n", val/10, val%10);
 }
 
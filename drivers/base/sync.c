@@ -19,6 +19,7 @@
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/math64.h>
 #include <linux/poll.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
@@ -136,20 +137,40 @@ void sync_timeline_signal(struct sync_timeline *obj)
 	unsigned long flags;
 	LIST_HEAD(signaled_pts);
 	struct list_head *pos, *n;
+	unsigned int count = 0;
+	ktime_t start;
+	u64 elapsed;
 
 	trace_sync_timeline(obj);
 
+	/*
+	 * Order the implementation's update of its counter (or of
+	 * obj->destroyed) before looking at the active list.  Pairs with
+	 * the barrier in sync_pt_activate(): either the pt being activated
+	 * sees the new state, or we see the pt.
+	 */
+	smp_mb();
+	if (list_empty(&obj->active_list_head))
+		return;
+
+	start = ktime_get();
 	spin_lock_irqsave(&obj->active_list_lock, flags);
 
+	/*
+	 * The active list is sorted by ops->compare(), so every pt after the
+	 * first one that has not signaled has not signaled either.
+	 */
 	list_for_each_safe(pos, n, &obj->active_list_head) {
 		struct sync_pt *pt =
 			container_of(pos, struct sync_pt, active_list);
 
-		if (_sync_pt_has_signaled(pt)) {
-			list_del_init(pos);
-			list_add(&pt->signaled_list, &signaled_pts);
-			kref_get(&pt->fence->kref);
-		}
+		if (!_sync_pt_has_signaled(pt))
+			break;
+
+		list_del_init(pos);
+		list_add_tail(&pt->signaled_list, &signaled_pts);
+		kref_get(&pt->fence->kref);
+		count++;
 	}
 
 	spin_unlock_irqrestore(&obj->active_list_lock, flags);
@@ -162,6 +183,16 @@ void sync_timeline_signal(struct sync_timeline *obj)
 		sync_fence_signal_pt(pt);
 		kref_put(&pt->fence->kref, sync_fence_free);
 	}
+
+	if (!count)
+		return;
+
+	elapsed = ktime_to_ns(ktime_sub(ktime_get(), start));
+	obj->signal_count++;
+	obj->signaled_pts += count;
+	obj->signal_ns_total += elapsed;
+	if (elapsed > obj->signal_ns_max)
+		obj->signal_ns_max = elapsed;
 }
 EXPORT_SYMBOL(sync_timeline_signal);
 
@@ -219,22 +250,36 @@ static struct sync_pt *sync_pt_dup(struct sync_pt *pt)
 	return pt->parent->ops->dup(pt);
 }
 
-/* Adds a sync pt to the active queue.  Called when added to a fence */
+/*
+ * Adds a sync pt to the active queue.  Called when added to a fence
+ *
+ * The pt goes after every active pt that signals no later than it.  Pts
+ * are usually created in signal order, so the search rarely goes past
+ * the tail.
+ */
 static void sync_pt_activate(struct sync_pt *pt)
 {
 	struct sync_timeline *obj = pt->parent;
+	struct sync_pt *entry;
 	unsigned long flags;
-	int err;
 
 	spin_lock_irqsave(&obj->active_list_lock, flags);
 
-	err = _sync_pt_has_signaled(pt);
-	if (err != 0)
-		goto out;
+	list_for_each_entry_reverse(entry, &obj->active_list_head,
+				    active_list) {
+		if (obj->ops->compare(pt, entry) >= 0)
+			break;
+	}
+	list_add(&pt->active_list, &entry->active_list);
 
-	list_add_tail(&pt->active_list, &obj->active_list_head);
+	/*
+	 * Only check the pt once it is on the list, see the barrier in
+	 * sync_timeline_signal().
+	 */
+	smp_mb();
+	if (_sync_pt_has_signaled(pt))
+		list_del_init(&pt->active_list);
 
-out:
 	spin_unlock_irqrestore(&obj->active_list_lock, flags);
 }
 
@@ -503,6 +548,11 @@ static void sync_fence_signal_pt(struct sync_pt *pt)
 		list_for_each_safe(pos, n, &fence->waiter_list_head)
 			list_move(pos, &signaled_waiters);
 
+		/*
+		 * Lockless readers of fence->status rely on the pt statuses
+		 * being visible once the fence's is.
+		 */
+		smp_wmb();
 		fence->status = status;
 	} else {
 		status = 0;
@@ -522,12 +572,18 @@ static void sync_fence_signal_pt(struct sync_pt *pt)
 	}
 }
 
+static bool sync_fence_check(struct sync_fence *fence);
+
 int sync_fence_wait_async(struct sync_fence *fence,
 			  struct sync_fence_waiter *waiter)
 {
 	unsigned long flags;
 	int err = 0;
 
+	/* status never goes back to 0, so a signaled fence needs no lock */
+	if (sync_fence_check(fence))
+		return fence->status;
+
 	spin_lock_irqsave(&fence->waiter_list_lock, flags);
 
 	if (fence->status) {
@@ -587,6 +643,10 @@ int sync_fence_wait(struct sync_fence *fence, long timeout)
 	int err = 0;
 	struct sync_pt *pt;
 
+	/* already signaled: skip the tracing and the wait queue altogether */
+	if (sync_fence_check(fence) && fence->status > 0)
+		return 0;
+
 	trace_sync_wait(fence, 1);
 	list_for_each_entry(pt, &fence->pt_list_head, pt_list)
 		trace_sync_pt(pt);
@@ -892,6 +952,11 @@ static void sync_print_obj(struct seq_file *s, struct sync_timeline *obj)
 	}
 
 	seq_printf(s, "\n");
+	if (obj->signal_count)
+		seq_printf(s, "  signals %lu pts %lu avg %lluns max %lluns\n",
+			   obj->signal_count, obj->signaled_pts,
+			   div64_u64(obj->signal_ns_total, obj->signal_count),
+			   obj->signal_ns_max);
 
 	spin_lock_irqsave(&obj->child_list_lock, flags);
 	list_for_each(pos, &obj->child_list_head) {
@@ -20,6 +20,8 @@
 #include <linux/kobject.h>
 #include <linux/spinlock.h>
 #include <linux/notifier.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
 #include <asm/cputime.h>
 
 static spinlock_t cpufreq_stats_lock;
@@ -30,6 +32,12 @@ static struct freq_attr _attr_##_name = {\
 	.show = _show,\
 };
 
+/*
+ * Histogram buckets are powers of two: bucket 0 counts values below 1,
+ * bucket n values in [2^(n-1), 2^n) and the last one everything above.
+ */
+#define CPUFREQ_STATS_HIST_BUCKETS	16
+
 struct cpufreq_stats {
 	unsigned int cpu;
 	unsigned int total_trans;
@@ -41,6 +49,16 @@ struct cpufreq_stats {
 	unsigned int *freq_table;
 #ifdef CONFIG_CPU_FREQ_STAT_DETAILS
 	unsigned int *trans_table;
+	/* per-visit residency in ms, CPUFREQ_STATS_HIST_BUCKETS per freq */
+	unsigned int *residency_hist;
+	ktime_t visit_start;
+	/* PRECHANGE to POSTCHANGE latency in us */
+	ktime_t trans_start;
+	unsigned int latency_hist[CPUFREQ_STATS_HIST_BUCKETS];
+	unsigned int latency_count;
+	u64 latency_total;
+	unsigned int latency_min;
+	unsigned int latency_max;
 #endif
 };
 
@@ -138,6 +156,92 @@ static ssize_t show_trans_table(struct cpufreq_policy *policy, char *buf)
 	return len;
 }
 CPUFREQ_STATDEVICE_ATTR(trans_table, 0444, show_trans_table);
+
+static unsigned int cpufreq_stats_hist_bucket(u64 val)
+{
+	return min_t(unsigned int, fls64(val), CPUFREQ_STATS_HIST_BUCKETS - 1);
+}
+
+static unsigned int cpufreq_stats_hist_lower(unsigned int bucket)
+{
+	return bucket ? 1U << (bucket - 1) : 0;
+}
+
+static ssize_t show_residency_histogram(struct cpufreq_policy *policy,
+					char *buf)
+{
+	ssize_t len = 0;
+	int i, j;
+
+	struct cpufreq_stats *stat = per_cpu(cpufreq_stats_table, policy->cpu);
+	if (!stat)
+		return 0;
+	len += snprintf(buf + len, PAGE_SIZE - len,
+			"   Freq  :    Visits of at least (ms)\n");
+	len += snprintf(buf + len, PAGE_SIZE - len, "         : ");
+	for (j = 0; j < CPUFREQ_STATS_HIST_BUCKETS; j++) {
+		if (len >= PAGE_SIZE)
+			break;
+		len += snprintf(buf + len, PAGE_SIZE - len, "%6u ",
+				cpufreq_stats_hist_lower(j));
+	}
+	if (len >= PAGE_SIZE)
+		return PAGE_SIZE;
+
+	len += snprintf(buf + len, PAGE_SIZE - len, "\n");
+
+	spin_lock(&cpufreq_stats_lock);
+	for (i = 0; i < stat->state_num; i++) {
+		if (len >= PAGE_SIZE)
+			break;
+
+		len += snprintf(buf + len, PAGE_SIZE - len, "%9u: ",
+				stat->freq_table[i]);
+
+		for (j = 0; j < CPUFREQ_STATS_HIST_BUCKETS; j++) {
+			if (len >= PAGE_SIZE)
+				break;
+			len += snprintf(buf + len, PAGE_SIZE - len, "%6u ",
+				stat->residency_hist[i *
+					CPUFREQ_STATS_HIST_BUCKETS + j]);
+		}
+		if (len >= PAGE_SIZE)
+			break;
+		len += snprintf(buf + len, PAGE_SIZE - len, "\n");
+	}
+	spin_unlock(&cpufreq_stats_lock);
+	if (len >= PAGE_SIZE)
+		return PAGE_SIZE;
+	return len;
+}
+CPUFREQ_STATDEVICE_ATTR(residency_histogram, 0444, show_residency_histogram);
+
+static ssize_t show_trans_latency(struct cpufreq_policy *policy, char *buf)
+{
+	ssize_t len = 0;
+	unsigned int count, min, avg, max;
+	unsigned int hist[CPUFREQ_STATS_HIST_BUCKETS];
+	int i;
+
+	struct cpufreq_stats *stat = per_cpu(cpufreq_stats_table, policy->cpu);
+	if (!stat)
+		return 0;
+	spin_lock(&cpufreq_stats_lock);
+	count = stat->latency_count;
+	min = stat->latency_min;
+	max = stat->latency_max;
+	avg = count ? div_u64(stat->latency_total, count) : 0;
+	memcpy(hist, stat->latency_hist, sizeof(hist));
+	spin_unlock(&cpufreq_stats_lock);
+
+	len += sprintf(buf + len, "count %u\nmin_us %u\navg_us %u\nmax_us %u\n",
+		       count, min, avg, max);
+	for (i = 0; i < CPUFREQ_STATS_HIST_BUCKETS; i++)
+		len += sprintf(buf + len, "%u %u\n",
+			       cpufreq_stats_hist_lower(i), hist[i]);
+	return len;
+}
+CPUFREQ_STATDEVICE_ATTR(trans_latency, 0444, show_trans_latency);
 #endif
 
 CPUFREQ_STATDEVICE_ATTR(total_trans, 0444, show_total_trans);
@@ -148,6 +252,8 @@ static struct attribute *default_attrs[] = {
 	&_attr_time_in_state.attr,
 #ifdef CONFIG_CPU_FREQ_STAT_DETAILS
 	&_attr_trans_table.attr,
+	&_attr_residency_histogram.attr,
+	&_attr_trans_latency.attr,
 #endif
 	NULL
 };
@@ -228,6 +334,7 @@ static int cpufreq_stats_create_table(struct cpufreq_policy *policy,
 
 #ifdef CONFIG_CPU_FREQ_STAT_DETAILS
 	alloc_size += count * count * sizeof(int);
+	alloc_size += count * CPUFREQ_STATS_HIST_BUCKETS * sizeof(int);
 #endif
 	stat->max_state = count;
 	stat->time_in_state = kzalloc(alloc_size, GFP_KERNEL);
@@ -239,6 +346,7 @@ static int cpufreq_stats_create_table(struct cpufreq_policy *policy,
 
 #ifdef CONFIG_CPU_FREQ_STAT_DETAILS
 	stat->trans_table = stat->freq_table + count;
+	stat->residency_hist = stat->trans_table + count * count;
 #endif
 	j = 0;
 	for (i = 0; table[i].frequency != CPUFREQ_TABLE_END; i++) {
@@ -252,6 +360,9 @@ static int cpufreq_stats_create_table(struct cpufreq_policy *policy,
 	spin_lock(&cpufreq_stats_lock);
 	stat->last_time = get_jiffies_64();
 	stat->last_index = freq_table_get_index(stat, policy->cur);
+#ifdef CONFIG_CPU_FREQ_STAT_DETAILS
+	stat->visit_start = ktime_get();
+#endif
 	spin_unlock(&cpufreq_stats_lock);
 	cpufreq_cpu_put(data);
 	return 0;
@@ -287,14 +398,48 @@ static int cpufreq_stat_notifier_trans(struct notifier_block *nb,
 	struct cpufreq_freqs *freq = data;
 	struct cpufreq_stats *stat;
 	int old_index, new_index;
+#ifdef CONFIG_CPU_FREQ_STAT_DETAILS
+	ktime_t now;
+	u64 delta;
+#endif
 
-	if (val != CPUFREQ_POSTCHANGE)
+	if (val != CPUFREQ_PRECHANGE && val != CPUFREQ_POSTCHANGE)
 		return 0;
 
 	stat = per_cpu(cpufreq_stats_table, freq->cpu);
 	if (!stat)
 		return 0;
 
+#ifdef CONFIG_CPU_FREQ_STAT_DETAILS
+	now = ktime_get();
+	if (val == CPUFREQ_PRECHANGE) {
+		spin_lock(&cpufreq_stats_lock);
+		stat->trans_start = now;
+		spin_unlock(&cpufreq_stats_lock);
+		return 0;
+	}
+
+	/* the driver notifies PRECHANGE and POSTCHANGE from the same call */
+	spin_lock(&cpufreq_stats_lock);
+	if (stat->trans_start.tv64) {
+		delta = ktime_to_us(ktime_sub(now, stat->trans_start));
+		if (delta > UINT_MAX)
+			delta = UINT_MAX;
+		if (!stat->latency_count || delta < stat->latency_min)
+			stat->latency_min = delta;
+		if (delta > stat->latency_max)
+			stat->latency_max = delta;
+		stat->latency_total += delta;
+		stat->latency_count++;
+		stat->latency_hist[cpufreq_stats_hist_bucket(delta)]++;
+		stat->trans_start.tv64 = 0;
+	}
+	spin_unlock(&cpufreq_stats_lock);
+#else
+	if (val != CPUFREQ_POSTCHANGE)
+		return 0;
+#endif
+
 	old_index = stat->last_index;
 	new_index = freq_table_get_index(stat, freq->new);
 
@@ -311,6 +456,11 @@ static int cpufreq_stat_notifier_trans(struct notifier_block *nb,
 	stat->last_index = new_index;
 #ifdef CONFIG_CPU_FREQ_STAT_DETAILS
 	stat->trans_table[old_index * stat->max_state + new_index]++;
+	delta = div_u64(ktime_to_us(ktime_sub(now, stat->visit_start)),
+			USEC_PER_MSEC);
+	stat->residency_hist[old_index * CPUFREQ_STATS_HIST_BUCKETS +
+			     cpufreq_stats_hist_bucket(delta)]++;
+	stat->visit_start = now;
 #endif
 	stat->total_trans++;
 	spin_unlock(&cpufreq_stats_lock);
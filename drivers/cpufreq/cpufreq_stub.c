@@ -0,0 +1,135 @@
+/*
+ * drivers/cpufreq/cpufreq_stub.c
+ *
+ * A software cpufreq driver for exercising governors where there is no
+ * frequency scaling hardware, e.g. under QEMU. Each CPU gets its own
+ * policy over a fixed frequency table; changing speed only sends the
+ * transition notifications, after waiting transition_us to stand in for
+ * the hardware switching.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/cpufreq.h>
+#include <linux/delay.h>
+#include <linux/percpu.h>
+
+static struct cpufreq_frequency_table stub_freq_table[] = {
+	{ .index = 0, .frequency = 384000 },
+	{ .index = 1, .frequency = 702000 },
+	{ .index = 2, .frequency = 1026000 },
+	{ .index = 3, .frequency = 1242000 },
+	{ .index = 4, .frequency = 1512000 },
+	{ .index = 5, .frequency = CPUFREQ_TABLE_END },
+};
+
+/* how long a speed change takes, in usecs */
+static unsigned int transition_us = 50;
+module_param(transition_us, uint, S_IRUGO | S_IWUSR);
+
+static DEFINE_PER_CPU(unsigned int, stub_cur_freq);
+
+static struct freq_attr *stub_cpufreq_attr[] = {
+	&cpufreq_freq_attr_scaling_available_freqs,
+	NULL,
+};
+
+static int stub_cpufreq_verify(struct cpufreq_policy *policy)
+{
+	return cpufreq_frequency_table_verify(policy, stub_freq_table);
+}
+
+static int stub_cpufreq_target(struct cpufreq_policy *policy,
+			       unsigned int target_freq,
+			       unsigned int relation)
+{
+	struct cpufreq_freqs freqs;
+	unsigned int idx;
+
+	if (cpufreq_frequency_table_target(policy, stub_freq_table,
+					   target_freq, relation, &idx))
+		return -EINVAL;
+
+	freqs.old = per_cpu(stub_cur_freq, policy->cpu);
+	freqs.new = stub_freq_table[idx].frequency;
+	freqs.cpu = policy->cpu;
+
+	if (freqs.old == freqs.new)
+		return 0;
+
+	cpufreq_notify_transition(&freqs, CPUFREQ_PRECHANGE);
+	udelay(transition_us);
+	per_cpu(stub_cur_freq, policy->cpu) = freqs.new;
+	cpufreq_notify_transition(&freqs, CPUFREQ_POSTCHANGE);
+
+	pr_debug("cpufreq_stub: cpu%u %u -> %u kHz\n", freqs.cpu,
+		 freqs.old, freqs.new);
+	return 0;
+}
+
+static unsigned int stub_cpufreq_get(unsigned int cpu)
+{
+	return per_cpu(stub_cur_freq, cpu);
+}
+
+static int stub_cpufreq_init(struct cpufreq_policy *policy)
+{
+	int ret;
+
+	ret = cpufreq_frequency_table_cpuinfo(policy, stub_freq_table);
+	if (ret)
+		return ret;
+	cpufreq_frequency_table_get_attr(stub_freq_table, policy->cpu);
+
+	/* start at the lowest speed, as after a cold boot */
+	if (!per_cpu(stub_cur_freq, policy->cpu))
+		per_cpu(stub_cur_freq, policy->cpu) =
+			policy->cpuinfo.min_freq;
+
+	policy->cur = per_cpu(stub_cur_freq, policy->cpu);
+	policy->cpuinfo.transition_latency = transition_us * NSEC_PER_USEC;
+
+	return 0;
+}
+
+static int stub_cpufreq_exit(struct cpufreq_policy *policy)
+{
+	cpufreq_frequency_table_put_attr(policy->cpu);
+	return 0;
+}
+
+static struct cpufreq_driver stub_cpufreq_driver = {
+	.verify	= stub_cpufreq_verify,
+	.target	= stub_cpufreq_target,
+	.get	= stub_cpufreq_get,
+	.init	= stub_cpufreq_init,
+	.exit	= stub_cpufreq_exit,
+	.name	= "stub",
+	.owner	= THIS_MODULE,
+	.attr	= stub_cpufreq_attr,
+};
+
+static int __init stub_cpufreq_register(void)
+{
+	return cpufreq_register_driver(&stub_cpufreq_driver);
+}
+
+static void __exit stub_cpufreq_unregister(void)
+{
+	cpufreq_unregister_driver(&stub_cpufreq_driver);
+}
+
+MODULE_DESCRIPTION("software cpufreq driver for testing governors");
+MODULE_LICENSE("GPL");
+
+module_init(stub_cpufreq_register);
+module_exit(stub_cpufreq_unregister);
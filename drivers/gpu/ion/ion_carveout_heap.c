@@ -17,10 +17,12 @@
 #include <linux/spinlock.h>
 
 #include <linux/err.h>
-#include <linux/genalloc.h>
 #include <linux/io.h>
 #include <linux/ion.h>
+#include <linux/math64.h>
 #include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/rbtree.h>
 #include <linux/scatterlist.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
@@ -31,9 +33,26 @@
 #include <mach/iommu_domains.h>
 #include <asm/mach/map.h>
 
+/*
+ * A free extent of the carveout.  Free extents are kept in two trees:
+ * by address, to merge a freed range with its neighbours, and by size,
+ * to find the smallest extent an allocation fits in.  Adjacent free
+ * extents are always merged, so the largest one is the largest
+ * allocation the heap can still satisfy.
+ */
+struct ion_carveout_extent {
+	struct rb_node addr_node;
+	struct rb_node size_node;
+	ion_phys_addr_t start;
+	unsigned long size;
+};
+
 struct ion_carveout_heap {
 	struct ion_heap heap;
-	struct gen_pool *pool;
+	struct mutex lock;
+	struct rb_root free_by_addr;
+	struct rb_root free_by_size;
+	unsigned int free_extents;
 	ion_phys_addr_t base;
 	unsigned long allocated_bytes;
 	unsigned long total_size;
@@ -43,29 +62,148 @@ struct ion_carveout_heap {
 	void *bus_id;
 };
 
+static void ion_carveout_insert_extent(struct ion_carveout_heap *carveout_heap,
+				       struct ion_carveout_extent *extent)
+{
+	struct rb_node **p = &carveout_heap->free_by_addr.rb_node;
+	struct rb_node *parent = NULL;
+	struct ion_carveout_extent *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct ion_carveout_extent, addr_node);
+
+		if (extent->start < entry->start)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&extent->addr_node, parent, p);
+	rb_insert_color(&extent->addr_node, &carveout_heap->free_by_addr);
+
+	p = &carveout_heap->free_by_size.rb_node;
+	parent = NULL;
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct ion_carveout_extent, size_node);
+
+		if (extent->size < entry->size ||
+		    (extent->size == entry->size && extent->start < entry->start))
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&extent->size_node, parent, p);
+	rb_insert_color(&extent->size_node, &carveout_heap->free_by_size);
+
+	carveout_heap->free_extents++;
+}
+
+static void ion_carveout_remove_extent(struct ion_carveout_heap *carveout_heap,
+				       struct ion_carveout_extent *extent)
+{
+	rb_erase(&extent->addr_node, &carveout_heap->free_by_addr);
+	rb_erase(&extent->size_node, &carveout_heap->free_by_size);
+	carveout_heap->free_extents--;
+}
+
+/* returns the smallest free extent that can hold size bytes at align */
+static struct ion_carveout_extent *ion_carveout_best_fit(
+				struct ion_carveout_heap *carveout_heap,
+				unsigned long size, unsigned long align)
+{
+	struct rb_node *n = carveout_heap->free_by_size.rb_node;
+	struct rb_node *first = NULL;
+	struct ion_carveout_extent *extent;
+
+	/* leftmost extent at least size bytes long */
+	while (n) {
+		extent = rb_entry(n, struct ion_carveout_extent, size_node);
+		if (extent->size >= size) {
+			first = n;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+
+	/* larger extents next, until one still fits once aligned */
+	for (n = first; n; n = rb_next(n)) {
+		extent = rb_entry(n, struct ion_carveout_extent, size_node);
+		if (ALIGN(extent->start, align) - extent->start + size <=
+		    extent->size)
+			return extent;
+	}
+	return NULL;
+}
+
+static unsigned long ion_carveout_largest_extent(
+				struct ion_carveout_heap *carveout_heap)
+{
+	struct rb_node *n = rb_last(&carveout_heap->free_by_size);
+
+	if (!n)
+		return 0;
+	return rb_entry(n, struct ion_carveout_extent, size_node)->size;
+}
+
 ion_phys_addr_t ion_carveout_allocate(struct ion_heap *heap,
 				      unsigned long size,
 				      unsigned long align)
 {
 	struct ion_carveout_heap *carveout_heap =
 		container_of(heap, struct ion_carveout_heap, heap);
-	unsigned long offset = gen_pool_alloc_aligned(carveout_heap->pool,
-							size, ilog2(align));
+	struct ion_carveout_extent *extent, *tail;
+	ion_phys_addr_t addr, end;
 
-	if (!offset) {
+	size = PAGE_ALIGN(size);
+	if (align < PAGE_SIZE)
+		align = PAGE_SIZE;
+
+	/* splitting an extent in the middle takes a new node for the tail */
+	tail = kmalloc(sizeof(struct ion_carveout_extent), GFP_KERNEL);
+	if (!tail)
+		return ION_CARVEOUT_ALLOCATE_FAIL;
+
+	mutex_lock(&carveout_heap->lock);
+	extent = ion_carveout_best_fit(carveout_heap, size, align);
+	if (!extent) {
 		if ((carveout_heap->total_size -
 		      carveout_heap->allocated_bytes) > size)
 			pr_debug("%s: heap %s has enough memory (%lx) but"
 				" the allocation of size %lx still failed."
-				" Memory is probably fragmented.",
+				" The largest free extent is %lx.",
 				__func__, heap->name,
 				carveout_heap->total_size -
-				carveout_heap->allocated_bytes, size);
+				carveout_heap->allocated_bytes, size,
+				ion_carveout_largest_extent(carveout_heap));
+		mutex_unlock(&carveout_heap->lock);
+		kfree(tail);
 		return ION_CARVEOUT_ALLOCATE_FAIL;
 	}
 
+	addr = ALIGN(extent->start, align);
+	end = extent->start + extent->size;
+	ion_carveout_remove_extent(carveout_heap, extent);
+
+	if (addr + size < end) {
+		tail->start = addr + size;
+		tail->size = end - tail->start;
+		ion_carveout_insert_extent(carveout_heap, tail);
+		tail = NULL;
+	}
+	if (addr > extent->start) {
+		extent->size = addr - extent->start;
+		ion_carveout_insert_extent(carveout_heap, extent);
+		extent = NULL;
+	}
+
 	carveout_heap->allocated_bytes += size;
-	return offset;
+	mutex_unlock(&carveout_heap->lock);
+
+	kfree(extent);
+	kfree(tail);
+	return addr;
 }
 
 void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
@@ -73,11 +211,55 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
 {
 	struct ion_carveout_heap *carveout_heap =
 		container_of(heap, struct ion_carveout_heap, heap);
+	struct ion_carveout_extent *extent, *prev = NULL, *next = NULL;
+	struct rb_node *n;
 
 	if (addr == ION_CARVEOUT_ALLOCATE_FAIL)
 		return;
-	gen_pool_free(carveout_heap->pool, addr, size);
+
+	size = PAGE_ALIGN(size);
+	/* a free that cannot be recorded would leak the range for good */
+	extent = kmalloc(sizeof(struct ion_carveout_extent),
+			 GFP_KERNEL | __GFP_NOFAIL);
+	extent->start = addr;
+	extent->size = size;
+
+	mutex_lock(&carveout_heap->lock);
+	/* find the free extents on either side of the range */
+	n = carveout_heap->free_by_addr.rb_node;
+	while (n) {
+		struct ion_carveout_extent *entry = rb_entry(n,
+					struct ion_carveout_extent, addr_node);
+
+		if (addr < entry->start) {
+			next = entry;
+			n = n->rb_left;
+		} else {
+			prev = entry;
+			n = n->rb_right;
+		}
+	}
+
+	if (prev && prev->start + prev->size == addr) {
+		ion_carveout_remove_extent(carveout_heap, prev);
+		extent->start = prev->start;
+		extent->size += prev->size;
+	} else {
+		prev = NULL;
+	}
+	if (next && addr + size == next->start) {
+		ion_carveout_remove_extent(carveout_heap, next);
+		extent->size += next->size;
+	} else {
+		next = NULL;
+	}
+	ion_carveout_insert_extent(carveout_heap, extent);
+
 	carveout_heap->allocated_bytes -= size;
+	mutex_unlock(&carveout_heap->lock);
+
+	kfree(prev);
+	kfree(next);
 }
 
 static int ion_carveout_heap_phys(struct ion_heap *heap,
@@ -257,10 +439,27 @@ static int ion_carveout_print_debug(struct ion_heap *heap, struct seq_file *s)
 {
 	struct ion_carveout_heap *carveout_heap =
 		container_of(heap, struct ion_carveout_heap, heap);
+	unsigned long free_bytes, largest;
+	unsigned int free_extents;
+
+	mutex_lock(&carveout_heap->lock);
+	free_bytes = carveout_heap->total_size - carveout_heap->allocated_bytes;
+	largest = ion_carveout_largest_extent(carveout_heap);
+	free_extents = carveout_heap->free_extents;
+	mutex_unlock(&carveout_heap->lock);
 
 	seq_printf(s, "total bytes currently allocated: %lx\n",
-		carveout_heap->allocated_bytes);
+		carveout_heap->total_size - free_bytes);
 	seq_printf(s, "total heap size: %lx\n", carveout_heap->total_size);
+	seq_printf(s, "free extents: %u\n", free_extents);
+	seq_printf(s, "largest free extent: %lx\n", largest);
+	/*
+	 * 0 when all free memory is one extent, approaching 1000 as it is
+	 * spread over many small ones.
+	 */
+	seq_printf(s, "fragmentation index: %lu/1000\n",
+		free_bytes ? 1000 - (unsigned long)div_u64((u64)largest * 1000,
+							   free_bytes) : 0);
 
 	return 0;
 }
@@ -474,25 +673,27 @@ static struct ion_heap_ops carveout_heap_ops = {
 struct ion_heap *ion_carveout_heap_create(struct ion_platform_heap *heap_data)
 {
 	struct ion_carveout_heap *carveout_heap;
-	int ret;
+	struct ion_carveout_extent *extent;
+
+	if (!heap_data->size)
+		return ERR_PTR(-EINVAL);
 
 	carveout_heap = kzalloc(sizeof(struct ion_carveout_heap), GFP_KERNEL);
 	if (!carveout_heap)
 		return ERR_PTR(-ENOMEM);
 
-	carveout_heap->pool = gen_pool_create(12, -1);
-	if (!carveout_heap->pool) {
+	extent = kmalloc(sizeof(struct ion_carveout_extent), GFP_KERNEL);
+	if (!extent) {
 		kfree(carveout_heap);
 		return ERR_PTR(-ENOMEM);
 	}
+	mutex_init(&carveout_heap->lock);
+	carveout_heap->free_by_addr = RB_ROOT;
+	carveout_heap->free_by_size = RB_ROOT;
 	carveout_heap->base = heap_data->base;
-	ret = gen_pool_add(carveout_heap->pool, carveout_heap->base,
-			heap_data->size, -1);
-	if (ret < 0) {
-		gen_pool_destroy(carveout_heap->pool);
-		kfree(carveout_heap);
-		return ERR_PTR(-EINVAL);
-	}
+	extent->start = carveout_heap->base;
+	extent->size = heap_data->size;
+	ion_carveout_insert_extent(carveout_heap, extent);
 	carveout_heap->heap.ops = &carveout_heap_ops;
 	carveout_heap->heap.type = ION_HEAP_TYPE_CARVEOUT;
 	carveout_heap->allocated_bytes = 0;
@@ -518,8 +719,15 @@ void ion_carveout_heap_destroy(struct ion_heap *heap)
 {
 	struct ion_carveout_heap *carveout_heap =
 	     container_of(heap, struct  ion_carveout_heap, heap);
+	struct rb_node *n;
+
+	while ((n = rb_first(&carveout_heap->free_by_addr))) {
+		struct ion_carveout_extent *extent = rb_entry(n,
+					struct ion_carveout_extent, addr_node);
 
-	gen_pool_destroy(carveout_heap->pool);
+		ion_carveout_remove_extent(carveout_heap, extent);
+		kfree(extent);
+	}
 	kfree(carveout_heap);
 	carveout_heap = NULL;
 }
@@ -0,0 +1,149 @@
+/*
+ * drivers/gpu/ion/ion_page_pool.c
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/err.h>
+#include <linux/gfp.h>
+#include <linux/jiffies.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include "ion_priv.h"
+
+static void ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
+{
+	spin_lock(&pool->lock);
+	list_add_tail(&page->lru, &pool->items);
+	pool->count++;
+	spin_unlock(&pool->lock);
+}
+
+static struct page *ion_page_pool_remove(struct ion_page_pool *pool)
+{
+	struct page *page = NULL;
+
+	spin_lock(&pool->lock);
+	if (pool->count) {
+		page = list_first_entry(&pool->items, struct page, lru);
+		list_del(&page->lru);
+		pool->count--;
+	}
+	spin_unlock(&pool->lock);
+
+	return page;
+}
+
+/*
+ * Tops the pool up to its fill level in the background, without entering
+ * reclaim: refilling is only worth it while memory is plentiful.  It is
+ * also held off for a while after the pool was shrunk.
+ */
+static void ion_page_pool_refill(struct work_struct *work)
+{
+	struct ion_page_pool *pool = container_of(work, struct ion_page_pool,
+						  refill_work);
+	gfp_t gfp_mask = (pool->gfp_mask | __GFP_NORETRY | __GFP_NOWARN) &
+			 ~__GFP_WAIT;
+	struct page *page;
+
+	for (;;) {
+		spin_lock(&pool->lock);
+		if (pool->count >= pool->fill ||
+		    time_before(jiffies, pool->refill_after)) {
+			spin_unlock(&pool->lock);
+			break;
+		}
+		spin_unlock(&pool->lock);
+
+		page = alloc_pages(gfp_mask, pool->order);
+		if (!page)
+			break;
+		ion_page_pool_add(pool, page);
+	}
+}
+
+struct page *ion_page_pool_alloc(struct ion_page_pool *pool)
+{
+	struct page *page;
+	bool refill;
+
+	page = ion_page_pool_remove(pool);
+
+	spin_lock(&pool->lock);
+	refill = pool->count < pool->fill;
+	spin_unlock(&pool->lock);
+	if (refill)
+		queue_work(system_unbound_wq, &pool->refill_work);
+
+	if (!page)
+		page = alloc_pages(pool->gfp_mask, pool->order);
+
+	return page;
+}
+
+void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
+{
+	ion_page_pool_add(pool, page);
+}
+
+int ion_page_pool_shrink(struct ion_page_pool *pool, int nr_to_scan)
+{
+	struct page *page;
+	int freed = 0;
+
+	spin_lock(&pool->lock);
+	pool->refill_after = jiffies + HZ;
+	spin_unlock(&pool->lock);
+
+	while (freed < nr_to_scan) {
+		page = ion_page_pool_remove(pool);
+		if (!page)
+			break;
+		__free_pages(page, pool->order);
+		freed += 1 << pool->order;
+	}
+
+	return freed;
+}
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order,
+					   int fill)
+{
+	struct ion_page_pool *pool = kmalloc(sizeof(struct ion_page_pool),
+					     GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	pool->count = 0;
+	pool->fill = fill;
+	INIT_LIST_HEAD(&pool->items);
+	spin_lock_init(&pool->lock);
+	pool->gfp_mask = gfp_mask;
+	pool->order = order;
+	pool->refill_after = jiffies;
+	INIT_WORK(&pool->refill_work, ion_page_pool_refill);
+
+	return pool;
+}
+
+void ion_page_pool_destroy(struct ion_page_pool *pool)
+{
+	struct page *page;
+
+	cancel_work_sync(&pool->refill_work);
+	while ((page = ion_page_pool_remove(pool)))
+		__free_pages(page, pool->order);
+	kfree(pool);
+}
@@ -19,9 +19,14 @@
 #define _ION_PRIV_H
 
 #include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/mm.h>
 #include <linux/mm_types.h>
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <linux/ion.h>
 #include <linux/iommu.h>
 
@@ -79,6 +84,7 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
  * struct ion_buffer - metadata for a particular buffer
  * @ref:		refernce count
  * @node:		node in the ion_device buffers tree
+ * @list:		element in the heap's deferred free list
  * @dev:		back pointer to the ion_device
  * @heap:		back pointer to the heap the buffer came from
  * @flags:		buffer specific flags
@@ -96,6 +102,7 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
 struct ion_buffer {
 	struct kref ref;
 	struct rb_node node;
+	struct list_head list;
 	struct ion_device *dev;
 	struct ion_heap *heap;
 	unsigned long flags;
@@ -160,16 +167,29 @@ struct ion_heap_ops {
 	int (*unsecure_heap)(struct ion_heap *heap);
 };
 
+/**
+ * heap flags - flags between the heaps and core ion code
+ */
+#define ION_HEAP_FLAG_DEFER_FREE (1 << 0)
+
 /**
  * struct ion_heap - represents a heap in the system
  * @node:		rb node to put the heap on the device's tree of heaps
  * @dev:		back pointer to the ion_device
  * @type:		type of heap
  * @ops:		ops struct as above
+ * @flags:		flags
  * @id:			id of heap, also indicates priority of this heap when
  *			allocating.  These are specified by platform data and
  *			MUST be unique
  * @name:		used for debugging
+ * @free_list:		buffers released by their last user, waiting to be
+ *			freed by @task (ION_HEAP_FLAG_DEFER_FREE only)
+ * @free_list_size:	size of the buffers on @free_list, in bytes
+ * @free_lock:		protects @free_list and @free_list_size
+ * @waitqueue:		@task waits here for buffers to free
+ * @task:		thread handing deferred buffers back to the heap
+ * @shrinker:		drains @free_list when memory is low
  *
  * Represents a pool of memory from which buffers can be made.  In some
  * systems the only heap is regular system memory allocated via vmalloc.
@@ -181,8 +201,15 @@ struct ion_heap {
 	struct ion_device *dev;
 	enum ion_heap_type type;
 	struct ion_heap_ops *ops;
+	unsigned long flags;
 	int id;
 	const char *name;
+	struct list_head free_list;
+	size_t free_list_size;
+	spinlock_t free_lock;
+	wait_queue_head_t waitqueue;
+	struct task_struct *task;
+	struct shrinker shrinker;
 };
 
 
@@ -223,6 +250,48 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap);
 struct ion_heap *ion_heap_create(struct ion_platform_heap *);
 void ion_heap_destroy(struct ion_heap *);
 
+/**
+ * ion_heap_init_deferred_free -- initialize deferred free functionality
+ * @heap:		the heap
+ *
+ * If a heap sets the ION_HEAP_FLAG_DEFER_FREE flag this function will
+ * be called to start a thread which frees the heap's buffers in the
+ * background.  The heap's free op, and any zeroing it does, then runs
+ * in that thread instead of in whoever dropped the last reference.
+ */
+int ion_heap_init_deferred_free(struct ion_heap *heap);
+
+/**
+ * ion_heap_freelist_add - add a buffer to the deferred free list
+ * @heap:		the heap
+ * @buffer:		the buffer
+ *
+ * Adds an item to the deferred freelist and wakes the thread freeing it.
+ */
+void ion_heap_freelist_add(struct ion_heap *heap, struct ion_buffer *buffer);
+
+/**
+ * ion_heap_freelist_drain - drain the deferred free list
+ * @heap:		the heap
+ * @size:		amount of memory to drain in bytes, 0 for all of it
+ *
+ * Frees buffers from the deferred free list synchronously until at least
+ * @size bytes have been freed.  Returns the number of bytes freed.
+ */
+size_t ion_heap_freelist_drain(struct ion_heap *heap, size_t size);
+
+/**
+ * ion_heap_freelist_size - returns the size of the deferred free list
+ * @heap:		the heap
+ */
+size_t ion_heap_freelist_size(struct ion_heap *heap);
+
+/**
+ * ion_buffer_free - hand a buffer back to its heap and release it
+ * @buffer:		the buffer, no longer referenced by anyone
+ */
+void ion_buffer_free(struct ion_buffer *buffer);
+
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *);
 void ion_system_heap_destroy(struct ion_heap *);
 
@@ -279,6 +348,49 @@ struct ion_heap *msm_get_contiguous_heap(void);
 void *ion_map_fmem_buffer(struct ion_buffer *buffer, unsigned long phys_base,
 				void *virt_base, unsigned long flags);
 
+/**
+ * struct ion_page_pool - pagepool struct
+ * @count:		number of items in the pool
+ * @fill:		number of items the pool is refilled to
+ * @items:		list of pages, linked through page->lru
+ * @lock:		protects the count and the list
+ * @gfp_mask:		gfp_mask to use from alloc
+ * @order:		order of pages in the pool
+ * @refill_after:	jiffies before which the pool is not refilled
+ * @refill_work:	work refilling the pool in the background
+ *
+ * Allows you to keep a pool of pre-allocated, zeroed pages to use from
+ * your heap, so that allocations neither wait on the page allocator for
+ * high order pages nor for the pages to be cleared.  Pages handed back
+ * with ion_page_pool_free() must already be zeroed.
+ */
+struct ion_page_pool {
+	int count;
+	int fill;
+	struct list_head items;
+	spinlock_t lock;
+	gfp_t gfp_mask;
+	unsigned int order;
+	unsigned long refill_after;
+	struct work_struct refill_work;
+};
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order,
+					   int fill);
+void ion_page_pool_destroy(struct ion_page_pool *);
+struct page *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+
+/**
+ * ion_page_pool_shrink - shrinks the size of the memory cached in the pool
+ * @pool:		the pool
+ * @nr_to_scan:		number of pages to free
+ *
+ * returns the number of pages freed, which may overshoot nr_to_scan by
+ * less than one item of the pool
+ */
+int ion_page_pool_shrink(struct ion_page_pool *pool, int nr_to_scan);
+
 /**
  * ion_do_cache_op - do cache operations.
  *
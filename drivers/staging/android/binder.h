@@ -147,6 +147,23 @@ struct binder_transaction_data {
 	} data;
 };
 
+/*
+ * One chunk of a scatter-gather transaction.  The chunks are copied back
+ * to back into the target buffer, so the offsets of a BC_TRANSACTION_SG
+ * index their concatenation.
+ */
+struct binder_sg_entry {
+	const void	*buffer;
+	size_t		length;
+};
+
+struct binder_transaction_data_sg {
+	/* data.ptr.buffer is ignored, data_size is the sum of all lengths */
+	struct binder_transaction_data	transaction_data;
+	const struct binder_sg_entry	*entries;
+	size_t				entry_count;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +341,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with the data
+	 * gathered from a list of user buffers instead of a single one.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
@@ -21,30 +21,111 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/lzo.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/*
+ * Positions in a log are free-running 32-bit byte counts rather than offsets
+ * into the buffer.  They double as sequence numbers: a reader whose position
+ * has fallen behind the head was lapped by the writers, whatever the buffer
+ * offsets happen to say.  So that a reader left idle cannot come back exactly
+ * a multiple of 4GB behind and look valid again, every LOGGER_FIXUP_STRIDE
+ * bytes written all the readers are fixed up, see logger_fixup_work().
+ *
+ * The committed write head and the start head live in a page of their own,
+ * which mmap() exposes read-only to user space ahead of the ring itself.
+ */
+#define LOGGER_POS_MASK		0xffffffffUL
+#define LOGGER_FIXUP_STRIDE	(1UL << 30)
+
+/* logger_pos - truncates 'n' to a log position */
+#define logger_pos(n)		((n) & LOGGER_POS_MASK)
+
+/* logger_before - is position 'a' before position 'b'? */
+#define logger_before(a, b)	(logger_pos((a) - (b)) > LOGGER_POS_MASK / 2)
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+/*
+ * struct logger_archive - the compressed half of a log
+ *
+ * Once more than half of the ring has not been archived yet, the oldest
+ * entries are compressed, LOGGER_ARCHIVE_CHUNK bytes at a time, into a ring
+ * of blocks here. Readers lapped in the ring carry on from the archive. The
+ * structure is protected by log->mutex.
+ */
+struct logger_archive {
+	unsigned char		*buffer; /* ring of compressed blocks */
+	size_t			size;	/* size of the ring, 0 if disabled */
+	size_t			head;	/* offset of the oldest block */
+	size_t			tail;	/* offset past the newest block */
+	size_t			used;	/* bytes in use from head to tail */
+	unsigned long		a_off;	/* position archived up to */
+	struct work_struct	work;	/* archives the oldest entries */
+};
+
+/*
+ * struct logger_block - a block of compressed entries in the archive
+ *
+ * A zero 'len', or too little room left to hold the header, pads out the end
+ * of the archive.
+ */
+struct logger_block {
+	__u32			pos;	/* position of the first entry */
+	__u16			len;	/* uncompressed length */
+	__u16			clen;	/* compressed length */
+	unsigned char		data[0]; /* LZO-compressed entries */
+};
+
+#define LOGGER_ARCHIVE_CHUNK	(8*1024)
+#endif
+
+/*
+ * struct logger_slot - the entry a cpu is writing to a log
+ *
+ * 'end' equals 'start' until the entry has been copied in. The slot is not
+ * reused before 'w_off' has moved past the entry.
+ */
+struct logger_slot {
+	unsigned long		start;	/* position of the entry */
+	unsigned long		end;	/* position past it once written */
+};
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Writers never take a lock. They reserve room by cmpxchg on 'reserve', copy
+ * their entry in and mark their cpu's slot written. 'w_off' then moves over
+ * the written entries in order, by whichever writer sees the next one done.
+ * 'head' is pushed forward, also by cmpxchg, before a writer overwrites the
+ * oldest entries. The mutex 'mutex' only serializes the readers.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	struct mutex		mutex;	/* mutex protecting the readers */
+	unsigned long		reserve; /* reserved write head */
+	struct logger_slot	slots[NR_CPUS]; /* entries being written */
+	struct work_struct	fixup;	/* fixes up idle readers */
+	struct logger_mmap_head	*shared; /* w_off and head, see above */
 	size_t			size;	/* size of the log */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	struct logger_archive	archive; /* compressed older entries */
+#endif
 };
 
 /*
@@ -56,9 +137,25 @@ struct logger_log {
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	unsigned long		r_off;	/* current read head position */
+	int			batch;	/* read() returns as many entries as fit */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	unsigned char		*unpacked; /* last archive block read */
+	unsigned long		u_pos;	/* position of 'unpacked' */
+	size_t			u_len;	/* length of 'unpacked' */
+#endif
+};
+
+/*
+ * struct logger_scratch - per-cpu staging area for an entry being written, so
+ * that the user copy, which may fault, happens before any room is reserved.
+ */
+struct logger_scratch {
+	unsigned char		buf[LOGGER_ENTRY_MAX_LEN];
 };
 
+static DEFINE_PER_CPU(struct logger_scratch, logger_scratch);
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
@@ -89,7 +186,8 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * The entry may be overwritten under us; callers must check the reader is
+ * still valid before trusting the result.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -108,16 +206,469 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * reader_valid - is position 'off' still between the oldest entry in the log
+ * and the committed write head? Once a writer has lapped it, whatever we
+ * read at 'off' may have been torn.
+ */
+static inline int reader_valid(struct logger_log *log, unsigned long off)
+{
+	unsigned long w_off = ACCESS_ONCE(log->shared->w_off);
+	unsigned long head;
+
+	smp_rmb();
+	head = ACCESS_ONCE(log->shared->head);
+
+	return logger_pos(off - head) <= logger_pos(w_off - head);
+}
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+
+/* shared by all logs; only the single-threaded archive workqueue uses them */
+static struct workqueue_struct *logger_archive_wq;
+static unsigned char *logger_lzo_src;
+static unsigned char *logger_lzo_dst;
+static void *logger_lzo_wrkmem;
+
+/*
+ * archive_next - returns the block at offset '*off' of the archive, stepping
+ * over the padding at the end of the ring, and moves '*off' past it. '*left'
+ * counts down the bytes in use; NULL is returned once it reaches zero.
+ */
+static struct logger_block *archive_next(struct logger_archive *ar,
+					 size_t *off, size_t *left)
+{
+	struct logger_block *blk;
+	size_t n;
+
+	while (*left) {
+		blk = (struct logger_block *) (ar->buffer + *off);
+		if (ar->size - *off < sizeof(*blk) || !blk->len) {
+			*left -= ar->size - *off;
+			*off = 0;
+			continue;
+		}
+
+		n = ALIGN(sizeof(*blk) + blk->clen, 4);
+		*left -= n;
+		*off += n;
+		if (*off == ar->size)
+			*off = 0;
+		return blk;
+	}
+
+	return NULL;
+}
+
+/* archive_drop - drops the oldest block of the archive */
+static void archive_drop(struct logger_archive *ar)
+{
+	size_t off = ar->head, left = ar->used;
+
+	archive_next(ar, &off, &left);
+	ar->head = off;
+	ar->used = left;
+}
+
+/*
+ * archive_add - appends the 'clen' bytes at 'data', compressed from the 'len'
+ * bytes of entries at position 'pos', to the archive, dropping the oldest
+ * blocks to make room. Blocks never wrap; the end of the ring is padded
+ * instead.
+ *
+ * Caller must hold log->mutex.
+ */
+static void archive_add(struct logger_archive *ar, unsigned long pos,
+			size_t len, const unsigned char *data, size_t clen)
+{
+	size_t need = ALIGN(sizeof(struct logger_block) + clen, 4);
+	size_t pad = ar->size - ar->tail;
+	struct logger_block *blk;
+
+	if (pad < need) {
+		while (ar->size - ar->used < pad)
+			archive_drop(ar);
+		if (pad >= sizeof(*blk)) {
+			blk = (struct logger_block *) (ar->buffer + ar->tail);
+			blk->len = 0;
+		}
+		ar->used += pad;
+		ar->tail = 0;
+	}
+
+	while (ar->size - ar->used < need)
+		archive_drop(ar);
+
+	blk = (struct logger_block *) (ar->buffer + ar->tail);
+	blk->pos = pos;
+	blk->len = len;
+	blk->clen = clen;
+	memcpy(blk->data, data, clen);
+
+	ar->used += need;
+	ar->tail += need;
+	if (ar->tail == ar->size)
+		ar->tail = 0;
+	ar->a_off = logger_pos(pos + len);
+}
+
+/*
+ * reader_unpacked_entry - returns the reader's next entry if it lies in the
+ * archive block the reader last decompressed, NULL otherwise.
+ */
+static inline unsigned char *reader_unpacked_entry(struct logger_reader *reader)
+{
+	size_t off = logger_pos(reader->r_off - reader->u_pos);
+
+	if (off >= reader->u_len)
+		return NULL;
+	return reader->unpacked + off;
+}
+
+/*
+ * reader_unpack - for a reader lapped in the ring, finds the archive block
+ * holding its position, or the next one if the position itself was lost,
+ * and decompresses it for the reader. Returns nonzero if the reader now
+ * reads from the archive.
  *
  * Caller must hold log->mutex.
  */
+static int reader_unpack(struct logger_log *log, struct logger_reader *reader)
+{
+	struct logger_archive *ar = &log->archive;
+	unsigned long w_off = ACCESS_ONCE(log->shared->w_off);
+	size_t off = ar->head, left = ar->used;
+	struct logger_block *blk;
+	unsigned long base;
+	size_t len;
+
+	blk = archive_next(ar, &off, &left);
+	if (!blk)
+		return 0;
+
+	/* measure everything from the oldest archived entry */
+	base = blk->pos;
+	if (logger_pos(reader->r_off - base) > logger_pos(w_off - base))
+		reader->r_off = base;
+
+	for (; blk; blk = archive_next(ar, &off, &left)) {
+		len = logger_pos(reader->r_off - base);
+		if (logger_pos(blk->pos + blk->len - base) <= len)
+			continue;
+		if (logger_pos(blk->pos - base) > len)
+			reader->r_off = blk->pos;
+
+		if (!reader->unpacked) {
+			reader->unpacked = kmalloc(LOGGER_ARCHIVE_CHUNK,
+						   GFP_KERNEL);
+			if (!reader->unpacked)
+				return 0;
+		}
+
+		len = LOGGER_ARCHIVE_CHUNK;
+		if (lzo1x_decompress_safe(blk->data, blk->clen,
+					  reader->unpacked, &len) != LZO_E_OK ||
+		    len != blk->len) {
+			reader->r_off = logger_pos(blk->pos + blk->len);
+			continue;
+		}
+
+		reader->u_pos = blk->pos;
+		reader->u_len = len;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * logger_oldest - returns the position of the oldest entry in 'log', archived
+ * or not.
+ *
+ * Caller must hold log->mutex.
+ */
+static unsigned long logger_oldest(struct logger_log *log)
+{
+	struct logger_archive *ar = &log->archive;
+	unsigned long w_off = ACCESS_ONCE(log->shared->w_off);
+	unsigned long head = ACCESS_ONCE(log->shared->head);
+	size_t off = ar->head, left = ar->used;
+	struct logger_block *blk;
+
+	blk = archive_next(ar, &off, &left);
+	if (blk && logger_pos(w_off - blk->pos) > logger_pos(w_off - head))
+		return blk->pos;
+	return head;
+}
+
+/*
+ * do_read_log - reads exactly 'count' bytes from 'log', starting at position
+ * 'off', into 'buf'.
+ */
+static void do_read_log(struct logger_log *log, unsigned long off, void *buf,
+			size_t count)
+{
+	size_t offset = logger_offset(off);
+	size_t len;
+
+	len = min(count, log->size - offset);
+	memcpy(buf, log->buffer + offset, len);
+
+	if (count != len)
+		memcpy(buf + len, log->buffer, count - len);
+}
+
+/*
+ * logger_archive_work - compresses the oldest entries of a log into its
+ * archive, LOGGER_ARCHIVE_CHUNK bytes at a time, until no more than half of
+ * the ring is left unarchived. Entries are read like any lapped reader would:
+ * should the writers overrun them meanwhile, they are lost.
+ */
+static void logger_archive_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      archive.work);
+	struct logger_archive *ar = &log->archive;
+	unsigned long pos, w_off;
+	size_t len, n, clen;
+
+	mutex_lock(&log->mutex);
+
+	while (1) {
+		if (!reader_valid(log, ar->a_off))
+			ar->a_off = ACCESS_ONCE(log->shared->head);
+
+		w_off = ACCESS_ONCE(log->shared->w_off);
+		if (logger_pos(w_off - ar->a_off) <= log->size / 2)
+			break;
+		smp_rmb();
+
+		/* gather as many whole entries as fit in a chunk */
+		len = 0;
+		for (pos = ar->a_off; pos != w_off; pos = logger_pos(pos + n)) {
+			n = get_entry_len(log, logger_offset(pos));
+			if (len + n > LOGGER_ARCHIVE_CHUNK)
+				break;
+			len += n;
+		}
+
+		do_read_log(log, ar->a_off, logger_lzo_src, len);
+		smp_rmb();
+		if (unlikely(!reader_valid(log, ar->a_off)))
+			continue;
+		if (unlikely(!len))
+			break;
+
+		lzo1x_1_compress(logger_lzo_src, len, logger_lzo_dst, &clen,
+				 logger_lzo_wrkmem);
+		archive_add(ar, ar->a_off, len, logger_lzo_dst, clen);
+	}
+
+	mutex_unlock(&log->mutex);
+}
+
+/*
+ * logger_archive_kick - called by writers once they have written up to 'end',
+ * to start archiving when more than half of the ring is unarchived.
+ */
+static inline void logger_archive_kick(struct logger_log *log,
+				       unsigned long end)
+{
+	if (log->archive.size &&
+	    logger_pos(end - ACCESS_ONCE(log->archive.a_off)) > log->size / 2)
+		queue_work(logger_archive_wq, &log->archive.work);
+}
+
+/*
+ * logger_archive_flush - empties the archive of 'log', up to position 'w_off'.
+ *
+ * Caller must hold log->mutex.
+ */
+static void logger_archive_flush(struct logger_log *log, unsigned long w_off)
+{
+	struct logger_reader *reader;
+
+	log->archive.head = 0;
+	log->archive.tail = 0;
+	log->archive.used = 0;
+	log->archive.a_off = w_off;
+
+	list_for_each_entry(reader, &log->readers, list)
+		reader->u_len = 0;
+}
+
+static inline void reader_forget_unpacked(struct logger_reader *reader)
+{
+	reader->u_len = 0;
+}
+
+static void reader_free_archive(struct logger_reader *reader)
+{
+	kfree(reader->unpacked);
+}
+
+/*
+ * logger_archive_setup - allocates what the archive workqueue needs. Without
+ * it, the logs just are not split.
+ */
+static int __init logger_archive_setup(void)
+{
+	logger_archive_wq = create_singlethread_workqueue("logger_archive");
+	logger_lzo_src = kmalloc(LOGGER_ARCHIVE_CHUNK, GFP_KERNEL);
+	logger_lzo_dst = kmalloc(lzo1x_worst_compress(LOGGER_ARCHIVE_CHUNK),
+				 GFP_KERNEL);
+	logger_lzo_wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+
+	if (!logger_archive_wq || !logger_lzo_src || !logger_lzo_dst ||
+	    !logger_lzo_wrkmem) {
+		printk(KERN_ERR "logger: failed to set up compression\n");
+		if (logger_archive_wq)
+			destroy_workqueue(logger_archive_wq);
+		kfree(logger_lzo_src);
+		kfree(logger_lzo_dst);
+		vfree(logger_lzo_wrkmem);
+		logger_archive_wq = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * logger_archive_init - gives the second half of the buffer of 'log' over to
+ * its archive.
+ */
+static void __init logger_archive_init(struct logger_log *log)
+{
+	INIT_WORK(&log->archive.work, logger_archive_work);
+	if (!logger_archive_wq)
+		return;
+
+	log->size /= 2;
+	log->shared->size = log->size;
+	log->archive.buffer = log->buffer + log->size;
+	log->archive.size = log->size;
+}
+
+#else
+
+static inline unsigned char *reader_unpacked_entry(struct logger_reader *reader)
+{
+	return NULL;
+}
+
+static inline int reader_unpack(struct logger_log *log,
+				struct logger_reader *reader)
+{
+	return 0;
+}
+
+static inline unsigned long logger_oldest(struct logger_log *log)
+{
+	return ACCESS_ONCE(log->shared->head);
+}
+
+static inline void logger_archive_kick(struct logger_log *log,
+				       unsigned long end)
+{
+}
+
+static inline void logger_archive_flush(struct logger_log *log,
+					unsigned long w_off)
+{
+}
+
+static inline void reader_forget_unpacked(struct logger_reader *reader)
+{
+}
+
+static inline void reader_free_archive(struct logger_reader *reader)
+{
+}
+
+static inline int logger_archive_setup(void)
+{
+	return 0;
+}
+
+static inline void logger_archive_init(struct logger_log *log)
+{
+}
+
+#endif /* CONFIG_ANDROID_LOGGER_COMPRESS */
+
+/*
+ * fix_up_reader - if the writers lapped 'reader', carry on from the archive
+ * or else pull it forward to the oldest entry still in the ring.
+ *
+ * Caller must hold log->mutex.
+ */
+static void fix_up_reader(struct logger_log *log, struct logger_reader *reader)
+{
+	if (reader_unpacked_entry(reader) || reader_valid(log, reader->r_off))
+		return;
+	if (!reader_unpack(log, reader))
+		reader->r_off = ACCESS_ONCE(log->shared->head);
+}
+
+/*
+ * logger_fixup_work - fixes up every reader lapped by the writers, so that
+ * none is left far enough behind for its position to wrap around and look
+ * valid again.
+ */
+static void logger_fixup_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log, fixup);
+	struct logger_reader *reader;
+
+	mutex_lock(&log->mutex);
+	list_for_each_entry(reader, &log->readers, list) {
+		if (reader_valid(log, reader->r_off))
+			continue;
+		/* whatever it unpacked may be just as stale */
+		reader_forget_unpacked(reader);
+		fix_up_reader(log, reader);
+	}
+	mutex_unlock(&log->mutex);
+}
+
+/*
+ * reader_next_len - returns the length of the entry at the reader's position,
+ * or zero if there is nothing to read. The reader is fixed up first.
+ *
+ * Caller must hold log->mutex.
+ */
+static size_t reader_next_len(struct logger_log *log,
+			      struct logger_reader *reader)
+{
+	struct logger_entry *entry;
+	size_t len;
+
+	do {
+		fix_up_reader(log, reader);
+		entry = (struct logger_entry *) reader_unpacked_entry(reader);
+		if (entry)
+			return sizeof(struct logger_entry) + entry->len;
+		if (reader->r_off == ACCESS_ONCE(log->shared->w_off))
+			return 0;
+		smp_rmb();
+		len = get_entry_len(log, logger_offset(reader->r_off));
+		smp_rmb();
+	} while (!reader_valid(log, reader->r_off));
+
+	return len;
+}
+
+/*
+ * do_read_log_to_user - reads exactly 'count' bytes from 'log', starting at
+ * position 'off', into the user-space buffer 'buf'. Returns 'count' on
+ * success.
+ */
 static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
+				   unsigned long off,
 				   char __user *buf,
 				   size_t count)
 {
+	size_t offset = logger_offset(off);
 	size_t len;
 
 	/*
@@ -125,8 +676,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - offset);
+	if (copy_to_user(buf, log->buffer + offset, len))
 		return -EFAULT;
 
 	/*
@@ -137,8 +688,6 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
@@ -149,7 +698,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or in batch mode (see
+ * 	  LOGGER_SET_READ_MODE) as many whole entries as fit in 'buf'
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -159,6 +709,8 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	unsigned char *entry;
+	size_t len, copied = 0;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -167,7 +719,8 @@ start:
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
 		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
+		fix_up_reader(log, reader);
+		ret = (ACCESS_ONCE(log->shared->w_off) == reader->r_off);
 		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
@@ -191,144 +744,247 @@ start:
 
 	mutex_lock(&log->mutex);
 
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
+	while (1) {
+		/* get the size of the next entry, if there still is one */
+		len = reader_next_len(log, reader);
+		if (!len)
+			break;
 
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
-	}
+		if (count - copied < len) {
+			if (!copied)
+				ret = -EINVAL;
+			break;
+		}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+		/* get exactly one entry, from the archive or from the log */
+		entry = reader_unpacked_entry(reader);
+		if (entry) {
+			if (copy_to_user(buf + copied, entry, len)) {
+				ret = -EFAULT;
+				break;
+			}
+		} else {
+			ret = do_read_log_to_user(log, reader->r_off,
+						  buf + copied, len);
+			if (ret < 0)
+				break;
+
+			/* if a writer lapped us during the copy, it's torn */
+			smp_rmb();
+			if (unlikely(!reader_valid(log, reader->r_off))) {
+				ret = 0;
+				continue;
+			}
+		}
+
+		reader->r_off = logger_pos(reader->r_off + len);
+		copied += len;
+
+		if (!reader->batch)
+			break;
+	}
 
-out:
 	mutex_unlock(&log->mutex);
 
-	return ret;
+	if (copied)
+		return copied;
+	if (ret)
+		return ret;
+
+	/* we raced and there is nothing left to read */
+	goto start;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
- *
- * Caller must hold log->mutex.
+ * logger_reserve - reserve 'len' bytes at the write head of 'log' in this
+ * cpu's slot. Returns the position of the reserved room.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static unsigned long logger_reserve(struct logger_log *log,
+				    struct logger_slot *slot, size_t len)
 {
-	size_t count = 0;
+	unsigned long old;
+
+	/* wait for the slot's previous entry to be published */
+	while (logger_before(ACCESS_ONCE(log->shared->w_off),
+			     ACCESS_ONCE(slot->end)))
+		cpu_relax();
 
 	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
+		old = ACCESS_ONCE(log->reserve);
+	} while (cmpxchg(&log->reserve, old, logger_pos(old + len)) != old);
+
+	slot->end = old;
+	smp_wmb();
+	slot->start = old;
 
-	return off;
+	return old;
 }
 
 /*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
+ * logger_publish - moves the committed write head over every written entry
+ * that directly follows it, whoever wrote them.
  */
-static inline int clock_interval(size_t a, size_t b, size_t c)
+static void logger_publish(struct logger_log *log)
 {
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
-	}
+	struct logger_slot *slot;
+	unsigned long w_off, start, end;
+	int cpu;
 
-	return 0;
+	while (1) {
+		w_off = ACCESS_ONCE(log->shared->w_off);
+		end = w_off;
+		for_each_possible_cpu(cpu) {
+			slot = &log->slots[cpu];
+			start = ACCESS_ONCE(slot->start);
+			smp_rmb();
+			end = ACCESS_ONCE(slot->end);
+			if (start == w_off && end != start)
+				break;
+			end = w_off;
+		}
+		if (end == w_off)
+			return;
+		cmpxchg(&log->shared->w_off, w_off, end);
+	}
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * logger_commit - marks the entry in this cpu's slot as written, and publishes
+ * it along with any later entries already written once all the earlier ones
+ * are.
  *
- * The caller needs to hold log->mutex.
+ * Either we see the write head reach our entry, or the writer moving it there
+ * sees our entry written and carries on over it.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void logger_commit(struct logger_log *log, struct logger_slot *slot,
+			  unsigned long end)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	smp_wmb();
+	slot->end = end;
+	smp_mb();
+	logger_publish(log);
+}
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+/*
+ * fix_up_head - pull the start head forward past every entry that writing up
+ * to position 'end' will clobber. Readers still pointing at those entries
+ * notice they were lapped by comparing against the new head.
+ *
+ * Entries this old were committed long ago, since a writer cannot sleep
+ * between reserving its room and committing it.
+ */
+static void fix_up_head(struct logger_log *log, unsigned long end)
+{
+	unsigned long head, next;
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	while (1) {
+		head = ACCESS_ONCE(log->shared->head);
+		if (logger_pos(end - head) <= log->size)
+			break;
+		next = logger_pos(head + get_entry_len(log,
+						       logger_offset(head)));
+		cmpxchg(&log->shared->head, head, next);
+	}
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at position 'off'
  *
- * The caller needs to hold log->mutex.
+ * The caller must have reserved the room.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, unsigned long off,
+			 const void *buf, size_t count)
 {
+	size_t offset = logger_offset(off);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - offset);
+	memcpy(log->buffer + offset, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
+}
+
+/*
+ * logger_write_entry - reserves room for the 'count' byte entry at 'buf',
+ * copies it into 'log' and commits it.
+ *
+ * The caller must have preemption disabled: readers cannot see past the
+ * oldest writer still in flight, so it must not sleep, and the slot is this
+ * cpu's.
+ */
+static void logger_write_entry(struct logger_log *log, const void *buf,
+			       size_t count)
+{
+	struct logger_slot *slot = &log->slots[smp_processor_id()];
+	unsigned long off;
+
+	off = logger_reserve(log, slot, count);
+
+	/*
+	 * Fix up the start head, pulling it forward to the first readable
+	 * entry after (what will be) the new write head, before we start
+	 * clobbering what it points at.
+	 */
+	fix_up_head(log, off + count);
 
-	log->w_off = logger_offset(log->w_off + count);
+	do_write_log(log, off, buf, count);
 
+	logger_commit(log, slot, logger_pos(off + count));
+
+	logger_archive_kick(log, off + count);
+
+	if ((off ^ (off + count)) & LOGGER_FIXUP_STRIDE)
+		schedule_work(&log->fixup);
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
+ * logger_copy_iov - gathers 'count' bytes of payload from the user-space
+ * vector 'iov' into 'buf'. With 'atomic' set, the copy must not fault.
  *
- * Returns 'count' on success, negative error code on failure.
+ * Returns zero on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int logger_copy_iov(unsigned char *buf, const struct iovec *iov,
+			   unsigned long nr_segs, size_t count, bool atomic)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	while (count && nr_segs-- > 0) {
+		size_t len = min_t(size_t, iov->iov_len, count);
+		unsigned long left;
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
+		if (atomic)
+			left = __copy_from_user_inatomic(buf, iov->iov_base,
+							 len);
+		else
+			left = copy_from_user(buf, iov->iov_base, len);
+		if (unlikely(left))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
+		buf += len;
+		count -= len;
+		iov++;
+	}
 
-	return count;
+	return 0;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The entry is assembled in this cpu's scratch buffer, copying the payload
+ * with page faults disabled. Should that fault, we fall back to a bounce
+ * buffer. Either way the log itself is only touched by a non-sleeping
+ * memcpy between reservation and commit.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
+	unsigned char *entry, *bounce = NULL;
 	struct timespec now;
-	ssize_t ret = 0;
+	int ret;
 
 	now = current_kernel_time();
 
@@ -337,48 +993,50 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	header.sec = now.tv_sec;
 	header.nsec = now.tv_nsec;
 	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	header.__pad = 0;
 
 	/* null writes succeed, return zero */
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
+	entry = get_cpu_var(logger_scratch).buf;
+	pagefault_disable();
+	ret = logger_copy_iov(entry + sizeof(struct logger_entry), iov,
+			      nr_segs, header.len, true);
+	pagefault_enable();
+	if (unlikely(ret)) {
+		put_cpu_var(logger_scratch);
 
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+		bounce = kmalloc(sizeof(struct logger_entry) + header.len,
+				 GFP_KERNEL);
+		if (!bounce)
+			return -ENOMEM;
 
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+		ret = logger_copy_iov(bounce + sizeof(struct logger_entry),
+				      iov, nr_segs, header.len, false);
+		if (unlikely(ret)) {
+			kfree(bounce);
+			return ret;
 		}
 
-		iov++;
-		ret += nr;
+		entry = bounce;
+		preempt_disable();
 	}
 
-	mutex_unlock(&log->mutex);
+	memcpy(entry, &header, sizeof(struct logger_entry));
+	logger_write_entry(log, entry,
+			   sizeof(struct logger_entry) + header.len);
+
+	if (bounce) {
+		preempt_enable();
+		kfree(bounce);
+	} else
+		put_cpu_var(logger_scratch);
 
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
 
-	return ret;
+	return header.len;
 }
 
 static struct logger_log *get_log_from_minor(int);
@@ -409,10 +1067,15 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
+		reader->batch = 0;
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+		reader->unpacked = NULL;
+		reader->u_len = 0;
+#endif
 		INIT_LIST_HEAD(&reader->list);
 
 		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
+		reader->r_off = logger_oldest(log);
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -436,6 +1099,7 @@ static int logger_release(struct inode *ignored, struct file *file)
 		mutex_lock(&log->mutex);
 		list_del(&reader->list);
 		mutex_unlock(&log->mutex);
+		reader_free_archive(reader);
 		kfree(reader);
 	}
 
@@ -466,17 +1130,47 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	fix_up_reader(log, reader);
+	if (ACCESS_ONCE(log->shared->w_off) != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the page holding the write and start heads, followed by the ring, for
+ * reading only. The mapping must cover both exactly.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	reader = file->private_data;
+	log = reader->log;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start != PAGE_SIZE + log->size)
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, log->shared, 0);
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	unsigned long w_off;
 	long ret = -ENOTTY;
 
 	mutex_lock(&log->mutex);
@@ -491,10 +1185,9 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		fix_up_reader(log, reader);
+		w_off = ACCESS_ONCE(log->shared->w_off);
+		ret = logger_pos(w_off - reader->r_off);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -502,19 +1195,35 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
-		else
-			ret = 0;
+		ret = reader_next_len(log, reader);
+		break;
+	case LOGGER_SET_READ_MODE:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		if (arg != LOGGER_READ_ENTRY && arg != LOGGER_READ_BATCH) {
+			ret = -EINVAL;
+			break;
+		}
+		reader = file->private_data;
+		reader->batch = (arg == LOGGER_READ_BATCH);
+		ret = 0;
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
+		/*
+		 * Racing writers are not stopped; whatever they commit after
+		 * this point survives the flush.
+		 */
+		w_off = ACCESS_ONCE(log->shared->w_off);
 		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+			reader->r_off = w_off;
+		log->shared->head = w_off;
+		logger_archive_flush(log, w_off);
 		ret = 0;
 		break;
 	}
@@ -529,6 +1238,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -538,12 +1248,11 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * LOGGER_FIXUP_STRIDE. The buffer and the shared heads are allocated by
+ * init_log().
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -553,8 +1262,7 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
-	.head = 0, \
+	.reserve = 0, \
 	.size = SIZE, \
 };
 
@@ -580,14 +1288,36 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+/*
+ * init_log - allocates the shared heads and the ring of 'log' and registers
+ * it. They come from vmalloc_user(), in one area with the heads in the first
+ * page, so that logger_mmap() can hand them to user space whether or not the
+ * logger is built as a module.
+ */
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->shared = vmalloc_user(PAGE_SIZE + log->size);
+	if (unlikely(!log->shared)) {
+		printk(KERN_ERR "logger: failed to allocate log '%s'!\n",
+		       log->misc.name);
+		return -ENOMEM;
+	}
+	log->shared->size = log->size;
+	log->shared->pos_mask = LOGGER_POS_MASK;
+	log->buffer = (unsigned char *) log->shared + PAGE_SIZE;
+
+	INIT_WORK(&log->fixup, logger_fixup_work);
+	logger_archive_init(log);
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		vfree(log->shared);
+		log->shared = NULL;
+		log->buffer = NULL;
 		return ret;
 	}
 
@@ -601,6 +1331,8 @@ static int __init logger_init(void)
 {
 	int ret;
 
+	logger_archive_setup();
+
 	ret = init_log(&log_main);
 	if (unlikely(ret))
 		goto out;
@@ -30,6 +30,22 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * struct logger_mmap_head - the first page of a log mapped with mmap(), which
+ * is followed by the ring itself.
+ *
+ * Positions are free-running and wrap at 'pos_mask'; the entry at position
+ * 'pos' starts at byte (pos & (size - 1)) of the ring. An entry copied out of
+ * the mapping is intact only if, re-reading the heads afterwards, its position
+ * still lies between 'head' and 'w_off'.
+ */
+struct logger_mmap_head {
+	__u32		w_off;	/* position after the last committed entry */
+	__u32		head;	/* position of the oldest entry */
+	__u32		size;	/* size of the ring */
+	__u32		pos_mask; /* mask positions wrap at */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -45,5 +61,10 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_READ_MODE		_IO(__LOGGERIO, 5) /* set read mode */
+
+/* arguments to LOGGER_SET_READ_MODE */
+#define LOGGER_READ_ENTRY	0	/* read() returns one entry (default) */
+#define LOGGER_READ_BATCH	1	/* read() returns all entries that fit */
 
 #endif /* _LINUX_LOGGER_H */
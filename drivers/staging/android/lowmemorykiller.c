@@ -37,6 +37,9 @@
 #include <linux/notifier.h>
 #include <linux/memory.h>
 #include <linux/memory_hotplug.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/spinlock.h>
 
 #define DEBUG_LEVEL_DEATHPENDING 6
 
@@ -146,6 +149,111 @@ static void dump_tasks(void)
 	}
 }
 
+/*
+ * Index of thread group leaders bucketed by oom_adj, so that picking a victim
+ * only looks at the highest non-empty buckets instead of at every process.
+ * Entries are added by the fork notifier, on oom_adj writes and when a thread
+ * takes over as leader by exec, and removed by the task free notifier. Those
+ * run in process context or from the RCU callback freeing tasks, never from
+ * hard irqs, so lowmem_index_lock only disables bottom halves. A task is only
+ * freed once its entry is gone, so under lowmem_index_lock the task an entry
+ * points to is always valid.
+ *
+ * If an entry cannot be allocated, the index is marked incomplete and we go
+ * back to scanning the whole task list.
+ */
+struct lowmem_task {
+	struct hlist_node hash;		/* entry in lowmem_task_hash */
+	struct list_head list;		/* entry in its oom_adj bucket */
+	struct task_struct *task;	/* thread group leader */
+	int oom_adj;			/* bucket we are in */
+};
+
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_HASH_BITS	8
+
+static struct list_head lowmem_buckets[LOWMEM_ADJ_BUCKETS];
+static struct hlist_head lowmem_task_hash[1 << LOWMEM_HASH_BITS];
+static DEFINE_SPINLOCK(lowmem_index_lock);
+static struct kmem_cache *lowmem_task_cachep;
+static int lowmem_index_incomplete;
+
+static inline struct list_head *lowmem_bucket(int oom_adj)
+{
+	return &lowmem_buckets[oom_adj - OOM_DISABLE];
+}
+
+/* lowmem_index_find - caller must hold lowmem_index_lock */
+static struct lowmem_task *lowmem_index_find(struct task_struct *task)
+{
+	struct hlist_head *head;
+	struct hlist_node *node;
+	struct lowmem_task *lt;
+
+	head = &lowmem_task_hash[hash_ptr(task, LOWMEM_HASH_BITS)];
+	hlist_for_each_entry(lt, node, head, hash)
+		if (lt->task == task)
+			return lt;
+
+	return NULL;
+}
+
+/*
+ * lowmem_index_update - adds the thread group leader 'task' to the index if
+ * it is not there yet, and files it under its current oom_adj.
+ */
+static void lowmem_index_update(struct task_struct *task)
+{
+	struct lowmem_task *lt, *new = NULL;
+	int oom_adj;
+
+	oom_adj = clamp_t(int, task->signal->oom_adj, OOM_DISABLE,
+			  OOM_ADJUST_MAX);
+
+	spin_lock_bh(&lowmem_index_lock);
+	lt = lowmem_index_find(task);
+	if (!lt) {
+		spin_unlock_bh(&lowmem_index_lock);
+		new = kmem_cache_alloc(lowmem_task_cachep, GFP_ATOMIC);
+		spin_lock_bh(&lowmem_index_lock);
+		lt = lowmem_index_find(task);
+	}
+	if (!lt) {
+		lt = new;
+		new = NULL;
+		if (!lt) {
+			lowmem_index_incomplete = 1;
+			goto out;
+		}
+		lt->task = task;
+		hlist_add_head(&lt->hash,
+			&lowmem_task_hash[hash_ptr(task, LOWMEM_HASH_BITS)]);
+		INIT_LIST_HEAD(&lt->list);
+	}
+	lt->oom_adj = oom_adj;
+	list_move(&lt->list, lowmem_bucket(oom_adj));
+out:
+	spin_unlock_bh(&lowmem_index_lock);
+	if (new)
+		kmem_cache_free(lowmem_task_cachep, new);
+}
+
+static void lowmem_index_remove(struct task_struct *task)
+{
+	struct lowmem_task *lt;
+
+	spin_lock_bh(&lowmem_index_lock);
+	lt = lowmem_index_find(task);
+	if (lt) {
+		hlist_del(&lt->hash);
+		list_del(&lt->list);
+	}
+	spin_unlock_bh(&lowmem_index_lock);
+
+	if (lt)
+		kmem_cache_free(lowmem_task_cachep, lt);
+}
+
 static int
 task_free_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -158,6 +266,8 @@ task_free_notify_func(struct notifier_block *self, unsigned long val, void *data
 {
 	struct task_struct *task = data;
 
+	lowmem_index_remove(task);
+
 	if (task == lowmem_deathpending) {
 		lowmem_deathpending = NULL;
 		lowmem_print(2, "deathpending end %d (%s)\n",
@@ -177,11 +287,34 @@ static struct notifier_block task_fork_nb = {
 static int
 task_fork_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
+	struct task_struct *task = data;
+
 	lowmem_fork_boost_timeout = jiffies + boost_duration;
 
+	if (thread_group_leader(task))
+		lowmem_index_update(task);
+
+	return NOTIFY_OK;
+}
+
+/*
+ * Called on oom_adj writes, and when a thread execs and takes over as leader
+ * of its thread group; the old leader's entry goes when it is freed.
+ */
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val, void *data)
+{
+	struct task_struct *task = data;
+
+	lowmem_index_update(task->group_leader);
+
 	return NOTIFY_OK;
 }
 
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
 static void dump_deathpending(struct task_struct *t_deathpending)
 {
 	struct task_struct *p;
@@ -244,12 +377,141 @@ static int lmk_hotplug_callback(struct notifier_block *self,
 
 
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+/*
+ * lowmem_select - picks the biggest process in the highest oom_adj bucket,
+ * from 'min_adj' up, that has one with memory to free.
+ *
+ * Call with tasklist_lock read-locked.
+ */
+static struct task_struct *lowmem_select(int min_adj, int *selected_tasksize,
+					 int *selected_oom_adj)
+{
+	struct task_struct *selected = NULL;
+	struct lowmem_task *lt;
+	int oom_adj;
+	int tasksize;
+
+	/*
+	 * 'min_adj' comes from the adj parameter unchecked; every task below
+	 * OOM_DISABLE is filed in its bucket anyway.
+	 */
+	min_adj = max(min_adj, OOM_DISABLE);
+
+	spin_lock_bh(&lowmem_index_lock);
+	for (oom_adj = OOM_ADJUST_MAX; oom_adj >= min_adj && !selected;
+	     oom_adj--) {
+		list_for_each_entry(lt, lowmem_bucket(oom_adj), list) {
+			struct task_struct *p = lt->task;
+
+			task_lock(p);
+			if (!p->mm) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(p->mm);
+			task_unlock(p);
+			if (tasksize <= 0)
+				continue;
+			if (selected && tasksize <= *selected_tasksize)
+				continue;
+			selected = p;
+			*selected_tasksize = tasksize;
+			*selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
+		}
+	}
+	spin_unlock_bh(&lowmem_index_lock);
+
+	return selected;
+}
+
+/*
+ * lowmem_select_scan - lowmem_select() the slow way, looking at every
+ * process, for when the index is incomplete.
+ *
+ * Call with tasklist_lock read-locked.
+ */
+static struct task_struct *lowmem_select_scan(int min_adj,
+					      int *selected_tasksize,
+					      int *selected_oom_adj)
+{
+	struct task_struct *selected = NULL;
+	struct task_struct *p;
+	int tasksize;
+
+	for_each_process(p) {
+		struct mm_struct *mm;
+		struct signal_struct *sig;
+		int oom_adj;
+
+		task_lock(p);
+		mm = p->mm;
+		sig = p->signal;
+		if (!mm || !sig) {
+			task_unlock(p);
+			continue;
+		}
+		oom_adj = sig->oom_adj;
+		if (oom_adj < min_adj) {
+			task_unlock(p);
+			continue;
+		}
+		tasksize = get_mm_rss(mm);
+		task_unlock(p);
+		if (tasksize <= 0)
+			continue;
+		if (selected) {
+			if (oom_adj < *selected_oom_adj)
+				continue;
+			if (oom_adj == *selected_oom_adj &&
+			    tasksize <= *selected_tasksize)
+				continue;
+		}
+		selected = p;
+		*selected_tasksize = tasksize;
+		*selected_oom_adj = oom_adj;
+		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+			     p->pid, p->comm, oom_adj, tasksize);
+	}
+
+	return selected;
+}
+
+/*
+ * index_missing - the pids of thread group leaders missing from the index or
+ * filed under a stale oom_adj, for tests. A process caught between fork and
+ * the fork notifier shows up briefly, so tests should look for their own.
+ */
+static int lowmem_index_missing_get(char *buffer, const struct kernel_param *kp)
 {
 	struct task_struct *p;
+	struct lowmem_task *lt;
+	int len = 0;
+
+	read_lock(&tasklist_lock);
+	spin_lock_bh(&lowmem_index_lock);
+	for_each_process(p) {
+		lt = lowmem_index_find(p);
+		if (!lt || lt->oom_adj != clamp_t(int, p->signal->oom_adj,
+						  OOM_DISABLE, OOM_ADJUST_MAX))
+			len += scnprintf(buffer + len, PAGE_SIZE - 1 - len,
+					 "%s%d", len ? " " : "", p->pid);
+	}
+	spin_unlock_bh(&lowmem_index_lock);
+	read_unlock(&tasklist_lock);
+
+	return len;
+}
+
+static struct kernel_param_ops lowmem_index_missing_ops = {
+	.get = lowmem_index_missing_get,
+};
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
 	struct task_struct *selected = NULL;
 	int rem = 0;
-	int tasksize;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
@@ -336,40 +598,12 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	selected_oom_adj = min_adj;
 
 	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
+	if (unlikely(lowmem_index_incomplete))
+		selected = lowmem_select_scan(min_adj, &selected_tasksize,
+					      &selected_oom_adj);
+	else
+		selected = lowmem_select(min_adj, &selected_tasksize,
+					 &selected_oom_adj);
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
@@ -415,8 +649,25 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	int i;
+
+	lowmem_task_cachep = KMEM_CACHE(lowmem_task, 0);
+	if (!lowmem_task_cachep)
+		return -ENOMEM;
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+
 	task_free_register(&task_free_nb);
 	task_fork_register(&task_fork_nb);
+	register_oom_adj_notifier(&oom_adj_nb);
+
+	/* index whatever was forked before we registered */
+	read_lock(&tasklist_lock);
+	for_each_process(p)
+		lowmem_index_update(p);
+	read_unlock(&tasklist_lock);
+
 	register_shrinker(&lowmem_shrinker);
 #ifdef CONFIG_MEMORY_HOTPLUG
 	hotplug_memory_notifier(lmk_hotplug_callback, 0);
@@ -426,11 +677,21 @@ static int __init lowmem_init(void)
 
 static void __exit lowmem_exit(void)
 {
+	struct lowmem_task *lt, *next;
+	int i;
+
 	unregister_shrinker(&lowmem_shrinker);
+	unregister_oom_adj_notifier(&oom_adj_nb);
 	task_fork_unregister(&task_fork_nb);
 	task_free_unregister(&task_free_nb);
+
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		list_for_each_entry_safe(lt, next, &lowmem_buckets[i], list)
+			kmem_cache_free(lowmem_task_cachep, lt);
+	kmem_cache_destroy(lowmem_task_cachep);
 }
 
+module_param_cb(index_missing, &lowmem_index_missing_ops, NULL, S_IRUGO);
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
 module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 			 S_IRUGO | S_IWUSR);
@@ -1,19 +1,16 @@
 /*
- * zcache.c
+ * zcache-main.c
  *
  * Copyright (c) 2010,2011, Dan Magenheimer, Oracle Corp.
  * Copyright (c) 2010,2011, Nitin Gupta
  *
  * Zcache provides an in-kernel "host implementation" for transcendent memory
- * and, thus indirectly, for cleancache and frontswap.  Zcache includes two
- * page-accessible memory [1] interfaces, both utilizing lzo1x compression:
- * 1) "compression buddies" ("zbud") is used for ephemeral pages
- * 2) xvmalloc is used for persistent pages.
- * Xvmalloc (based on the TLSF allocator) has very low fragmentation
- * so maximizes space efficiency, while zbud allows pairs (and potentially,
- * in the future, more than a pair of) compressed pages to be closely linked
- * so that reclaiming can be done via the kernel's physical-page-oriented
- * "shrinker" interface.
+ * and, thus indirectly, for cleancache and frontswap.  Zcache stores
+ * page-accessible memory [1] compressed with lzo1x, on per-cpu buffers,
+ * in zsmalloc pools: one for ephemeral and one for persistent pages.
+ * Zsmalloc packs as many compressed pages per physical page as their
+ * sizes allow, while ephemeral pages are kept in LRU order so that
+ * reclaiming can be done via the kernel's "shrinker" interface.
  *
  * [1] For a definition of page-accessible memory (aka PAM), see:
  *   http://marc.info/?l=linux-mm&m=127811271605009
@@ -29,7 +26,7 @@
 #include <linux/atomic.h>
 #include "tmem.h"
 
-#include "../zram/xvmalloc.h" /* if built in drivers/staging */
+#include "../zram/zsmalloc.h" /* if built in drivers/staging */
 
 #if (!defined(CONFIG_CLEANCACHE) && !defined(CONFIG_FRONTSWAP))
 #error "zcache is useless without CONFIG_CLEANCACHE or CONFIG_FRONTSWAP"
@@ -50,620 +47,243 @@
 #endif
 
 /**********
- * Compression buddies ("zbud") provides for packing two (or, possibly
- * in the future, more) compressed ephemeral pages into a single "raw"
- * (physical) page and tracking them with data structures so that
- * the raw pages can be easily reclaimed.
+ * Compressed pages, ephemeral and persistent, are packed into zsmalloc
+ * pools: objects of a size class share multi-page zspages back to back,
+ * so the number of compressed pages per physical page is only limited
+ * by how well they compress, rather than capped at two as it was with
+ * zbud.  Ephemeral and persistent pages use separate pools, so that
+ * their density can be tracked and ephemeral pages reclaimed apart.
  *
- * A zbud page ("zbpg") is an aligned page containing a list_head,
- * a lock, and two "zbud headers".  The remainder of the physical
- * page is divided up into aligned 64-byte "chunks" which contain
- * the compressed data for zero, one, or two zbuds.  Each zbpg
- * resides on: (1) an "unused list" if it has no zbuds; (2) a
- * "buddied" list if it is fully populated  with two zbuds; or
- * (3) one of PAGE_SIZE/64 "unbuddied" lists indexed by how many chunks
- * the one unbuddied zbud uses.  The data inside a zbpg cannot be
- * read or written unless the zbpg's lock is held.
+ * Each stored page is described by a "zc header" (the pampd) that
+ * holds its zsmalloc handle and where it came from.  Ephemeral headers
+ * are kept on an LRU list so that the shrinker can evict the oldest
+ * pages first; zsmalloc's own shrinker then compacts the freed space
+ * into whole pages.  zsmalloc locks per size class, so puts and gets
+ * on different cpus only contend when they hit the same class.
  */
 
-#define ZBH_SENTINEL  0x43214321
-#define ZBPG_SENTINEL  0xdeadbeef
+#define ZCH_SENTINEL  0x43214321
 
-#define ZBUD_MAX_BUDS 2
-
-struct zbud_hdr {
+struct zc_hdr {
+	struct list_head lru;	/* ephemeral pages only */
+	unsigned long handle;
 	uint32_t pool_id;
 	struct tmem_oid oid;
 	uint32_t index;
-	uint16_t size; /* compressed size in bytes, zero means unused */
+	uint16_t size;		/* compressed size in bytes */
 	DECL_SENTINEL
 };
 
-struct zbud_page {
-	struct list_head bud_list;
-	spinlock_t lock;
-	struct zbud_hdr buddy[ZBUD_MAX_BUDS];
-	DECL_SENTINEL
-	/* followed by NUM_CHUNK aligned CHUNK_SIZE-byte chunks */
-};
+/* pages that compress to more than this are not worth storing */
+static const int zc_max_page_size = (PAGE_SIZE / 8) * 7;
 
-#define CHUNK_SHIFT	6
-#define CHUNK_SIZE	(1 << CHUNK_SHIFT)
-#define CHUNK_MASK	(~(CHUNK_SIZE-1))
-#define NCHUNKS		(((PAGE_SIZE - sizeof(struct zbud_page)) & \
-				CHUNK_MASK) >> CHUNK_SHIFT)
-#define MAX_CHUNK	(NCHUNKS-1)
+static struct zs_pool *zcache_eph_zspool;
+static struct zs_pool *zcache_pers_zspool;
 
-static struct {
-	struct list_head list;
-	unsigned count;
-} zbud_unbuddied[NCHUNKS];
-/* list N contains pages with N chunks USED and NCHUNKS-N unused */
-/* element 0 is never used but optimizing that isn't worth it */
-static unsigned long zbud_cumul_chunk_counts[NCHUNKS];
-
-struct list_head zbud_buddied_list;
-static unsigned long zcache_zbud_buddied_count;
-
-/* protects the buddied list and all unbuddied lists */
-static DEFINE_SPINLOCK(zbud_budlists_spinlock);
-
-static LIST_HEAD(zbpg_unused_list);
-static unsigned long zcache_zbpg_unused_list_count;
-
-/* protects the unused page list */
-static DEFINE_SPINLOCK(zbpg_unused_list_spinlock);
-
-static atomic_t zcache_zbud_curr_raw_pages;
-static atomic_t zcache_zbud_curr_zpages;
-static unsigned long zcache_zbud_curr_zbytes;
-static unsigned long zcache_zbud_cumul_zpages;
-static unsigned long zcache_zbud_cumul_zbytes;
+/* ephemeral pages, least recently stored first */
+static LIST_HEAD(zcache_eph_lru);
+static DEFINE_SPINLOCK(zcache_eph_lru_lock);
+
+static atomic_t zcache_eph_zpages;
+static atomic_t zcache_pers_zpages;
+static atomic_long_t zcache_eph_zbytes;
+static atomic_long_t zcache_pers_zbytes;
 static unsigned long zcache_compress_poor;
 
 /* forward references */
-static void *zcache_get_free_page(void);
-static void zcache_free_page(void *p);
-
-/*
- * zbud helper functions
- */
-
-static inline unsigned zbud_max_buddy_size(void)
-{
-	return MAX_CHUNK << CHUNK_SHIFT;
-}
-
-static inline unsigned zbud_size_to_chunks(unsigned size)
-{
-	BUG_ON(size == 0 || size > zbud_max_buddy_size());
-	return (size + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
-}
-
-static inline int zbud_budnum(struct zbud_hdr *zh)
-{
-	unsigned offset = (unsigned long)zh & (PAGE_SIZE - 1);
-	struct zbud_page *zbpg = NULL;
-	unsigned budnum = -1U;
-	int i;
-
-	for (i = 0; i < ZBUD_MAX_BUDS; i++)
-		if (offset == offsetof(typeof(*zbpg), buddy[i])) {
-			budnum = i;
-			break;
-		}
-	BUG_ON(budnum == -1U);
-	return budnum;
-}
-
-static char *zbud_data(struct zbud_hdr *zh, unsigned size)
-{
-	struct zbud_page *zbpg;
-	char *p;
-	unsigned budnum;
-
-	ASSERT_SENTINEL(zh, ZBH);
-	budnum = zbud_budnum(zh);
-	BUG_ON(size == 0 || size > zbud_max_buddy_size());
-	zbpg = container_of(zh, struct zbud_page, buddy[budnum]);
-	ASSERT_SPINLOCK(&zbpg->lock);
-	p = (char *)zbpg;
-	if (budnum == 0)
-		p += ((sizeof(struct zbud_page) + CHUNK_SIZE - 1) &
-							CHUNK_MASK);
-	else if (budnum == 1)
-		p += PAGE_SIZE - ((size + CHUNK_SIZE - 1) & CHUNK_MASK);
-	return p;
-}
+static struct zc_hdr *zcache_get_zhdr(void);
+static void zcache_free_zhdr(struct zc_hdr *zh);
 
-/*
- * zbud raw page management
- */
-
-static struct zbud_page *zbud_alloc_raw_page(void)
-{
-	struct zbud_page *zbpg = NULL;
-	struct zbud_hdr *zh0, *zh1;
-	bool recycled = 0;
-
-	/* if any pages on the zbpg list, use one */
-	spin_lock(&zbpg_unused_list_spinlock);
-	if (!list_empty(&zbpg_unused_list)) {
-		zbpg = list_first_entry(&zbpg_unused_list,
-				struct zbud_page, bud_list);
-		list_del_init(&zbpg->bud_list);
-		zcache_zbpg_unused_list_count--;
-		recycled = 1;
-	}
-	spin_unlock(&zbpg_unused_list_spinlock);
-	if (zbpg == NULL)
-		/* none on zbpg list, try to get a kernel page */
-		zbpg = zcache_get_free_page();
-	if (likely(zbpg != NULL)) {
-		INIT_LIST_HEAD(&zbpg->bud_list);
-		zh0 = &zbpg->buddy[0]; zh1 = &zbpg->buddy[1];
-		spin_lock_init(&zbpg->lock);
-		if (recycled) {
-			ASSERT_INVERTED_SENTINEL(zbpg, ZBPG);
-			SET_SENTINEL(zbpg, ZBPG);
-			BUG_ON(zh0->size != 0 || tmem_oid_valid(&zh0->oid));
-			BUG_ON(zh1->size != 0 || tmem_oid_valid(&zh1->oid));
-		} else {
-			atomic_inc(&zcache_zbud_curr_raw_pages);
-			INIT_LIST_HEAD(&zbpg->bud_list);
-			SET_SENTINEL(zbpg, ZBPG);
-			zh0->size = 0; zh1->size = 0;
-			tmem_oid_set_invalid(&zh0->oid);
-			tmem_oid_set_invalid(&zh1->oid);
-		}
-	}
-	return zbpg;
-}
+/* per-cpu buffer for compressed data, see zcache_compress() */
+static DEFINE_PER_CPU(unsigned char *, zcache_dstmem);
 
-static void zbud_free_raw_page(struct zbud_page *zbpg)
+static struct zc_hdr *zc_create(struct tmem_pool *pool, struct tmem_oid *oid,
+				uint32_t index, void *cdata, unsigned clen)
 {
-	struct zbud_hdr *zh0 = &zbpg->buddy[0], *zh1 = &zbpg->buddy[1];
-
-	ASSERT_SENTINEL(zbpg, ZBPG);
-	BUG_ON(!list_empty(&zbpg->bud_list));
-	ASSERT_SPINLOCK(&zbpg->lock);
-	BUG_ON(zh0->size != 0 || tmem_oid_valid(&zh0->oid));
-	BUG_ON(zh1->size != 0 || tmem_oid_valid(&zh1->oid));
-	INVERT_SENTINEL(zbpg, ZBPG);
-	spin_unlock(&zbpg->lock);
-	spin_lock(&zbpg_unused_list_spinlock);
-	list_add(&zbpg->bud_list, &zbpg_unused_list);
-	zcache_zbpg_unused_list_count++;
-	spin_unlock(&zbpg_unused_list_spinlock);
-}
-
-/*
- * core zbud handling routines
- */
+	bool ephemeral = is_ephemeral(pool);
+	struct zs_pool *zspool = ephemeral ? zcache_eph_zspool :
+						zcache_pers_zspool;
+	struct zc_hdr *zh = NULL;
+	unsigned long handle;
 
-static unsigned zbud_free(struct zbud_hdr *zh)
-{
-	unsigned size;
-
-	ASSERT_SENTINEL(zh, ZBH);
-	BUG_ON(!tmem_oid_valid(&zh->oid));
-	size = zh->size;
-	BUG_ON(zh->size == 0 || zh->size > zbud_max_buddy_size());
-	zh->size = 0;
-	tmem_oid_set_invalid(&zh->oid);
-	INVERT_SENTINEL(zh, ZBH);
-	zcache_zbud_curr_zbytes -= size;
-	atomic_dec(&zcache_zbud_curr_zpages);
-	return size;
-}
+	BUG_ON(!irqs_disabled());
+	handle = zs_malloc(zspool, clen, ZCACHE_GFP_MASK | __GFP_HIGHMEM);
+	if (unlikely(!handle))
+		goto out;
+	zs_write(zspool, handle, cdata, clen);
 
-static void zbud_free_and_delist(struct zbud_hdr *zh)
-{
-	unsigned chunks;
-	struct zbud_hdr *zh_other;
-	unsigned budnum = zbud_budnum(zh), size;
-	struct zbud_page *zbpg =
-		container_of(zh, struct zbud_page, buddy[budnum]);
-
-	spin_lock(&zbpg->lock);
-	if (list_empty(&zbpg->bud_list)) {
-		/* ignore zombie page... see zbud_evict_pages() */
-		spin_unlock(&zbpg->lock);
-		return;
-	}
-	size = zbud_free(zh);
-	ASSERT_SPINLOCK(&zbpg->lock);
-	zh_other = &zbpg->buddy[(budnum == 0) ? 1 : 0];
-	if (zh_other->size == 0) { /* was unbuddied: unlist and free */
-		chunks = zbud_size_to_chunks(size) ;
-		spin_lock(&zbud_budlists_spinlock);
-		BUG_ON(list_empty(&zbud_unbuddied[chunks].list));
-		list_del_init(&zbpg->bud_list);
-		zbud_unbuddied[chunks].count--;
-		spin_unlock(&zbud_budlists_spinlock);
-		zbud_free_raw_page(zbpg);
-	} else { /* was buddied: move remaining buddy to unbuddied list */
-		chunks = zbud_size_to_chunks(zh_other->size) ;
-		spin_lock(&zbud_budlists_spinlock);
-		list_del_init(&zbpg->bud_list);
-		zcache_zbud_buddied_count--;
-		list_add_tail(&zbpg->bud_list, &zbud_unbuddied[chunks].list);
-		zbud_unbuddied[chunks].count++;
-		spin_unlock(&zbud_budlists_spinlock);
-		spin_unlock(&zbpg->lock);
+	zh = zcache_get_zhdr();
+	SET_SENTINEL(zh, ZCH);
+	zh->handle = handle;
+	zh->pool_id = pool->pool_id;
+	zh->oid = *oid;
+	zh->index = index;
+	zh->size = clen;
+	INIT_LIST_HEAD(&zh->lru);
+	if (ephemeral) {
+		spin_lock(&zcache_eph_lru_lock);
+		list_add_tail(&zh->lru, &zcache_eph_lru);
+		spin_unlock(&zcache_eph_lru_lock);
+		atomic_inc(&zcache_eph_zpages);
+		atomic_long_add(clen, &zcache_eph_zbytes);
+	} else {
+		atomic_inc(&zcache_pers_zpages);
+		atomic_long_add(clen, &zcache_pers_zbytes);
 	}
+out:
+	return zh;
 }
 
-static struct zbud_hdr *zbud_create(uint32_t pool_id, struct tmem_oid *oid,
-					uint32_t index, struct page *page,
-					void *cdata, unsigned size)
+static void zc_free(struct tmem_pool *pool, struct zc_hdr *zh)
 {
-	struct zbud_hdr *zh0, *zh1, *zh = NULL;
-	struct zbud_page *zbpg = NULL, *ztmp;
-	unsigned nchunks;
-	char *to;
-	int i, found_good_buddy = 0;
-
-	nchunks = zbud_size_to_chunks(size) ;
-	for (i = MAX_CHUNK - nchunks + 1; i > 0; i--) {
-		spin_lock(&zbud_budlists_spinlock);
-		if (!list_empty(&zbud_unbuddied[i].list)) {
-			list_for_each_entry_safe(zbpg, ztmp,
-				    &zbud_unbuddied[i].list, bud_list) {
-				if (spin_trylock(&zbpg->lock)) {
-					found_good_buddy = i;
-					goto found_unbuddied;
-				}
-			}
-		}
-		spin_unlock(&zbud_budlists_spinlock);
+	ASSERT_SENTINEL(zh, ZCH);
+	BUG_ON(zh->size == 0 || zh->size > zc_max_page_size);
+	if (is_ephemeral(pool)) {
+		/* may already be off the list, see zc_evict_pages() */
+		spin_lock(&zcache_eph_lru_lock);
+		list_del_init(&zh->lru);
+		spin_unlock(&zcache_eph_lru_lock);
+		zs_free(zcache_eph_zspool, zh->handle);
+		atomic_dec(&zcache_eph_zpages);
+		atomic_long_sub(zh->size, &zcache_eph_zbytes);
+	} else {
+		zs_free(zcache_pers_zspool, zh->handle);
+		atomic_dec(&zcache_pers_zpages);
+		atomic_long_sub(zh->size, &zcache_pers_zbytes);
 	}
-	/* didn't find a good buddy, try allocating a new page */
-	zbpg = zbud_alloc_raw_page();
-	if (unlikely(zbpg == NULL))
-		goto out;
-	/* ok, have a page, now compress the data before taking locks */
-	spin_lock(&zbpg->lock);
-	spin_lock(&zbud_budlists_spinlock);
-	list_add_tail(&zbpg->bud_list, &zbud_unbuddied[nchunks].list);
-	zbud_unbuddied[nchunks].count++;
-	zh = &zbpg->buddy[0];
-	goto init_zh;
-
-found_unbuddied:
-	ASSERT_SPINLOCK(&zbpg->lock);
-	zh0 = &zbpg->buddy[0]; zh1 = &zbpg->buddy[1];
-	BUG_ON(!((zh0->size == 0) ^ (zh1->size == 0)));
-	if (zh0->size != 0) { /* buddy0 in use, buddy1 is vacant */
-		ASSERT_SENTINEL(zh0, ZBH);
-		zh = zh1;
-	} else if (zh1->size != 0) { /* buddy1 in use, buddy0 is vacant */
-		ASSERT_SENTINEL(zh1, ZBH);
-		zh = zh0;
-	} else
-		BUG();
-	list_del_init(&zbpg->bud_list);
-	zbud_unbuddied[found_good_buddy].count--;
-	list_add_tail(&zbpg->bud_list, &zbud_buddied_list);
-	zcache_zbud_buddied_count++;
-
-init_zh:
-	SET_SENTINEL(zh, ZBH);
-	zh->size = size;
-	zh->index = index;
-	zh->oid = *oid;
-	zh->pool_id = pool_id;
-	/* can wait to copy the data until the list locks are dropped */
-	spin_unlock(&zbud_budlists_spinlock);
-
-	to = zbud_data(zh, size);
-	memcpy(to, cdata, size);
-	spin_unlock(&zbpg->lock);
-	zbud_cumul_chunk_counts[nchunks]++;
-	atomic_inc(&zcache_zbud_curr_zpages);
-	zcache_zbud_cumul_zpages++;
-	zcache_zbud_curr_zbytes += size;
-	zcache_zbud_cumul_zbytes += size;
-out:
-	return zh;
+	INVERT_SENTINEL(zh, ZCH);
+	zcache_free_zhdr(zh);
 }
 
-static int zbud_decompress(struct page *page, struct zbud_hdr *zh)
+static int zc_decompress(struct page *page, struct tmem_pool *pool,
+				struct zc_hdr *zh)
 {
-	struct zbud_page *zbpg;
-	unsigned budnum = zbud_budnum(zh);
-	size_t out_len = PAGE_SIZE;
-	char *to_va, *from_va;
-	unsigned size;
-	int ret = 0;
+	unsigned char *cdata = __get_cpu_var(zcache_dstmem);
+	size_t clen = PAGE_SIZE;
+	char *to_va;
+	int ret;
 
-	zbpg = container_of(zh, struct zbud_page, buddy[budnum]);
-	spin_lock(&zbpg->lock);
-	if (list_empty(&zbpg->bud_list)) {
-		/* ignore zombie page... see zbud_evict_pages() */
-		ret = -EINVAL;
-		goto out;
-	}
-	ASSERT_SENTINEL(zh, ZBH);
-	BUG_ON(zh->size == 0 || zh->size > zbud_max_buddy_size());
+	BUG_ON(!irqs_disabled());
+	ASSERT_SENTINEL(zh, ZCH);
+	BUG_ON(zh->size == 0 || zh->size > zc_max_page_size);
+	if (unlikely(cdata == NULL))
+		return -ENOMEM;  /* no buffer, so can't decompress */
+	zs_read(is_ephemeral(pool) ? zcache_eph_zspool : zcache_pers_zspool,
+		zh->handle, cdata, zh->size);
 	to_va = kmap_atomic(page, KM_USER0);
-	size = zh->size;
-	from_va = zbud_data(zh, size);
-	ret = lzo1x_decompress_safe(from_va, size, to_va, &out_len);
-	BUG_ON(ret != LZO_E_OK);
-	BUG_ON(out_len != PAGE_SIZE);
+	ret = lzo1x_decompress_safe(cdata, zh->size, to_va, &clen);
 	kunmap_atomic(to_va, KM_USER0);
-out:
-	spin_unlock(&zbpg->lock);
-	return ret;
+	BUG_ON(ret != LZO_E_OK);
+	BUG_ON(clen != PAGE_SIZE);
+	return 0;
 }
 
 /*
  * The following routines handle shrinking of ephemeral pages by evicting
- * pages "least valuable" first.
+ * the least recently stored first.
  */
 
-static unsigned long zcache_evicted_raw_pages;
-static unsigned long zcache_evicted_buddied_pages;
-static unsigned long zcache_evicted_unbuddied_pages;
+static unsigned long zcache_evicted_eph_pages;
 
 static struct tmem_pool *zcache_get_pool_by_id(uint32_t poolid);
 static void zcache_put_pool(struct tmem_pool *pool);
 
 /*
- * Flush and free all zbuds in a zbpg, then free the pageframe
+ * Evict about nr pages worth of compressed data.  A header taken off the
+ * LRU list stays valid until it is flushed, but only its tmem coordinates
+ * are used once the list is unlocked: the page may meanwhile have been
+ * flushed or replaced, in which case there is nothing (or a newer copy)
+ * to drop, and either is fine for ephemeral pages.
  */
-static void zbud_evict_zbpg(struct zbud_page *zbpg)
+static void zc_evict_pages(int nr)
 {
-	struct zbud_hdr *zh;
-	int i, j;
-	uint32_t pool_id[ZBUD_MAX_BUDS], index[ZBUD_MAX_BUDS];
-	struct tmem_oid oid[ZBUD_MAX_BUDS];
+	long bytes = (long)nr << PAGE_SHIFT;
 	struct tmem_pool *pool;
+	struct zc_hdr *zh;
+	struct tmem_oid oid;
+	uint32_t pool_id, index;
+	unsigned long flags;
 
-	ASSERT_SPINLOCK(&zbpg->lock);
-	BUG_ON(!list_empty(&zbpg->bud_list));
-	for (i = 0, j = 0; i < ZBUD_MAX_BUDS; i++) {
-		zh = &zbpg->buddy[i];
-		if (zh->size) {
-			pool_id[j] = zh->pool_id;
-			oid[j] = zh->oid;
-			index[j] = zh->index;
-			j++;
-			zbud_free(zh);
+	while (bytes > 0) {
+		local_irq_save(flags);
+		spin_lock(&zcache_eph_lru_lock);
+		if (list_empty(&zcache_eph_lru)) {
+			spin_unlock(&zcache_eph_lru_lock);
+			local_irq_restore(flags);
+			break;
 		}
-	}
-	spin_unlock(&zbpg->lock);
-	for (i = 0; i < j; i++) {
-		pool = zcache_get_pool_by_id(pool_id[i]);
+		zh = list_first_entry(&zcache_eph_lru, struct zc_hdr, lru);
+		list_del_init(&zh->lru);
+		pool_id = zh->pool_id;
+		oid = zh->oid;
+		index = zh->index;
+		bytes -= zh->size;
+		spin_unlock(&zcache_eph_lru_lock);
+
+		pool = zcache_get_pool_by_id(pool_id);
 		if (pool != NULL) {
-			tmem_flush_page(pool, &oid[i], index[i]);
+			if (tmem_flush_page(pool, &oid, index) >= 0)
+				zcache_evicted_eph_pages++;
 			zcache_put_pool(pool);
 		}
+		local_irq_restore(flags);
 	}
-	ASSERT_SENTINEL(zbpg, ZBPG);
-	spin_lock(&zbpg->lock);
-	zbud_free_raw_page(zbpg);
-}
-
-/*
- * Free nr pages.  This code is funky because we want to hold the locks
- * protecting various lists for as short a time as possible, and in some
- * circumstances the list may change asynchronously when the list lock is
- * not held.  In some cases we also trylock not only to avoid waiting on a
- * page in use by another cpu, but also to avoid potential deadlock due to
- * lock inversion.
- */
-static void zbud_evict_pages(int nr)
-{
-	struct zbud_page *zbpg;
-	int i;
-
-	/* first try freeing any pages on unused list */
-retry_unused_list:
-	spin_lock_bh(&zbpg_unused_list_spinlock);
-	if (!list_empty(&zbpg_unused_list)) {
-		/* can't walk list here, since it may change when unlocked */
-		zbpg = list_first_entry(&zbpg_unused_list,
-				struct zbud_page, bud_list);
-		list_del_init(&zbpg->bud_list);
-		zcache_zbpg_unused_list_count--;
-		atomic_dec(&zcache_zbud_curr_raw_pages);
-		spin_unlock_bh(&zbpg_unused_list_spinlock);
-		zcache_free_page(zbpg);
-		zcache_evicted_raw_pages++;
-		if (--nr <= 0)
-			goto out;
-		goto retry_unused_list;
-	}
-	spin_unlock_bh(&zbpg_unused_list_spinlock);
-
-	/* now try freeing unbuddied pages, starting with least space avail */
-	for (i = 0; i < MAX_CHUNK; i++) {
-retry_unbud_list_i:
-		spin_lock_bh(&zbud_budlists_spinlock);
-		if (list_empty(&zbud_unbuddied[i].list)) {
-			spin_unlock_bh(&zbud_budlists_spinlock);
-			continue;
-		}
-		list_for_each_entry(zbpg, &zbud_unbuddied[i].list, bud_list) {
-			if (unlikely(!spin_trylock(&zbpg->lock)))
-				continue;
-			list_del_init(&zbpg->bud_list);
-			zbud_unbuddied[i].count--;
-			spin_unlock(&zbud_budlists_spinlock);
-			zcache_evicted_unbuddied_pages++;
-			/* want budlists unlocked when doing zbpg eviction */
-			zbud_evict_zbpg(zbpg);
-			local_bh_enable();
-			if (--nr <= 0)
-				goto out;
-			goto retry_unbud_list_i;
-		}
-		spin_unlock_bh(&zbud_budlists_spinlock);
-	}
-
-	/* as a last resort, free buddied pages */
-retry_bud_list:
-	spin_lock_bh(&zbud_budlists_spinlock);
-	if (list_empty(&zbud_buddied_list)) {
-		spin_unlock_bh(&zbud_budlists_spinlock);
-		goto out;
-	}
-	list_for_each_entry(zbpg, &zbud_buddied_list, bud_list) {
-		if (unlikely(!spin_trylock(&zbpg->lock)))
-			continue;
-		list_del_init(&zbpg->bud_list);
-		zcache_zbud_buddied_count--;
-		spin_unlock(&zbud_budlists_spinlock);
-		zcache_evicted_buddied_pages++;
-		/* want budlists unlocked when doing zbpg eviction */
-		zbud_evict_zbpg(zbpg);
-		local_bh_enable();
-		if (--nr <= 0)
-			goto out;
-		goto retry_bud_list;
-	}
-	spin_unlock_bh(&zbud_budlists_spinlock);
-out:
-	return;
 }
 
-static void zbud_init(void)
+#ifdef CONFIG_SYSFS
+static int zc_show_pages(char *buf, struct zs_pool *zspool)
 {
-	int i;
+	unsigned long pages = 0;
 
-	INIT_LIST_HEAD(&zbud_buddied_list);
-	zcache_zbud_buddied_count = 0;
-	for (i = 0; i < NCHUNKS; i++) {
-		INIT_LIST_HEAD(&zbud_unbuddied[i].list);
-		zbud_unbuddied[i].count = 0;
-	}
+	if (zspool != NULL)
+		pages = zs_get_total_size_bytes(zspool) >> PAGE_SHIFT;
+	return sprintf(buf, "%lu\n", pages);
 }
 
-#ifdef CONFIG_SYSFS
 /*
- * These sysfs routines show a nice distribution of how many zbpg's are
- * currently (and have ever been placed) in each unbuddied list.  It's fun
- * to watch but can probably go away before final merge.
+ * Density is the number of compressed pages held per physical page used,
+ * in percent: 200 would be two pages per page, the most zbud could do.
  */
-static int zbud_show_unbuddied_list_counts(char *buf)
+static int zc_show_density(char *buf, struct zs_pool *zspool, atomic_t *zpages)
 {
-	int i;
-	char *p = buf;
+	unsigned long pages = 0;
 
-	for (i = 0; i < NCHUNKS - 1; i++)
-		p += sprintf(p, "%u ", zbud_unbuddied[i].count);
-	p += sprintf(p, "%d\n", zbud_unbuddied[i].count);
-	return p - buf;
+	if (zspool != NULL)
+		pages = zs_get_total_size_bytes(zspool) >> PAGE_SHIFT;
+	return sprintf(buf, "%lu\n", pages == 0 ? 0 :
+			(unsigned long)atomic_read(zpages) * 100 / pages);
 }
 
-static int zbud_show_cumul_chunk_counts(char *buf)
+static int zc_show_eph_pages(char *buf)
 {
-	unsigned long i, chunks = 0, total_chunks = 0, sum_total_chunks = 0;
-	unsigned long total_chunks_lte_21 = 0, total_chunks_lte_32 = 0;
-	unsigned long total_chunks_lte_42 = 0;
-	char *p = buf;
-
-	for (i = 0; i < NCHUNKS; i++) {
-		p += sprintf(p, "%lu ", zbud_cumul_chunk_counts[i]);
-		chunks += zbud_cumul_chunk_counts[i];
-		total_chunks += zbud_cumul_chunk_counts[i];
-		sum_total_chunks += i * zbud_cumul_chunk_counts[i];
-		if (i == 21)
-			total_chunks_lte_21 = total_chunks;
-		if (i == 32)
-			total_chunks_lte_32 = total_chunks;
-		if (i == 42)
-			total_chunks_lte_42 = total_chunks;
-	}
-	p += sprintf(p, "<=21:%lu <=32:%lu <=42:%lu, mean:%lu\n",
-		total_chunks_lte_21, total_chunks_lte_32, total_chunks_lte_42,
-		chunks == 0 ? 0 : sum_total_chunks / chunks);
-	return p - buf;
+	return zc_show_pages(buf, zcache_eph_zspool);
 }
-#endif
-
-/**********
- * This "zv" PAM implementation combines the TLSF-based xvMalloc
- * with lzo1x compression to maximize the amount of data that can
- * be packed into a physical page.
- *
- * Zv represents a PAM page with the index and object (plus a "size" value
- * necessary for decompression) immediately preceding the compressed data.
- */
-
-#define ZVH_SENTINEL  0x43214321
-
-struct zv_hdr {
-	uint32_t pool_id;
-	struct tmem_oid oid;
-	uint32_t index;
-	DECL_SENTINEL
-};
-
-static const int zv_max_page_size = (PAGE_SIZE / 8) * 7;
 
-static struct zv_hdr *zv_create(struct xv_pool *xvpool, uint32_t pool_id,
-				struct tmem_oid *oid, uint32_t index,
-				void *cdata, unsigned clen)
+static int zc_show_pers_pages(char *buf)
 {
-	struct page *page;
-	struct zv_hdr *zv = NULL;
-	uint32_t offset;
-	int ret;
+	return zc_show_pages(buf, zcache_pers_zspool);
+}
 
-	BUG_ON(!irqs_disabled());
-	ret = xv_malloc(xvpool, clen + sizeof(struct zv_hdr),
-			&page, &offset, ZCACHE_GFP_MASK);
-	if (unlikely(ret))
-		goto out;
-	zv = kmap_atomic(page, KM_USER0) + offset;
-	zv->index = index;
-	zv->oid = *oid;
-	zv->pool_id = pool_id;
-	SET_SENTINEL(zv, ZVH);
-	memcpy((char *)zv + sizeof(struct zv_hdr), cdata, clen);
-	kunmap_atomic(zv, KM_USER0);
-out:
-	return zv;
+static int zc_show_eph_density(char *buf)
+{
+	return zc_show_density(buf, zcache_eph_zspool, &zcache_eph_zpages);
 }
 
-static void zv_free(struct xv_pool *xvpool, struct zv_hdr *zv)
+static int zc_show_pers_density(char *buf)
 {
-	unsigned long flags;
-	struct page *page;
-	uint32_t offset;
-	uint16_t size;
-
-	ASSERT_SENTINEL(zv, ZVH);
-	size = xv_get_object_size(zv) - sizeof(*zv);
-	BUG_ON(size == 0 || size > zv_max_page_size);
-	INVERT_SENTINEL(zv, ZVH);
-	page = virt_to_page(zv);
-	offset = (unsigned long)zv & ~PAGE_MASK;
-	local_irq_save(flags);
-	xv_free(xvpool, page, offset);
-	local_irq_restore(flags);
+	return zc_show_density(buf, zcache_pers_zspool, &zcache_pers_zpages);
 }
 
-static void zv_decompress(struct page *page, struct zv_hdr *zv)
+static int zc_show_eph_zbytes(char *buf)
 {
-	size_t clen = PAGE_SIZE;
-	char *to_va;
-	unsigned size;
-	int ret;
+	return sprintf(buf, "%ld\n", atomic_long_read(&zcache_eph_zbytes));
+}
 
-	ASSERT_SENTINEL(zv, ZVH);
-	size = xv_get_object_size(zv) - sizeof(*zv);
-	BUG_ON(size == 0 || size > zv_max_page_size);
-	to_va = kmap_atomic(page, KM_USER0);
-	ret = lzo1x_decompress_safe((char *)zv + sizeof(*zv),
-					size, to_va, &clen);
-	kunmap_atomic(to_va, KM_USER0);
-	BUG_ON(ret != LZO_E_OK);
-	BUG_ON(clen != PAGE_SIZE);
+static int zc_show_pers_zbytes(char *buf)
+{
+	return sprintf(buf, "%ld\n", atomic_long_read(&zcache_pers_zbytes));
 }
+#endif
 
 /*
  * zcache core code starts here
@@ -681,7 +301,6 @@ static unsigned long zcache_failed_pers_puts;
 
 static struct {
 	struct tmem_pool *tmem_pools[MAX_POOLS_PER_CLIENT];
-	struct xv_pool *xvpool;
 } zcache_client;
 
 /*
@@ -710,7 +329,6 @@ static void zcache_put_pool(struct tmem_pool *pool)
 }
 
 /* counters for debugging */
-static unsigned long zcache_failed_get_free_pages;
 static unsigned long zcache_failed_alloc;
 static unsigned long zcache_put_to_flush;
 static unsigned long zcache_aborted_preload;
@@ -719,9 +337,11 @@ static unsigned long zcache_aborted_shrink;
 /*
  * Ensure that memory allocation requests in zcache don't result
  * in direct reclaim requests via the shrinker, which would cause
- * an infinite loop.  Maybe a GFP flag would be better?
+ * an infinite loop.  Maybe a GFP flag would be better?  Preloads
+ * only exclude the shrinker, not each other, so puts on different
+ * cpus can proceed in parallel.
  */
-static DEFINE_SPINLOCK(zcache_direct_reclaim_lock);
+static DEFINE_RWLOCK(zcache_direct_reclaim_lock);
 
 /*
  * for now, used named slabs so can easily track usage; later can
@@ -730,6 +350,7 @@ static DEFINE_SPINLOCK(zcache_direct_reclaim_lock);
  */
 static struct kmem_cache *zcache_objnode_cache;
 static struct kmem_cache *zcache_obj_cache;
+static struct kmem_cache *zcache_zhdr_cache;
 static atomic_t zcache_curr_obj_count = ATOMIC_INIT(0);
 static unsigned long zcache_curr_obj_count_max;
 static atomic_t zcache_curr_objnode_count = ATOMIC_INIT(0);
@@ -741,7 +362,7 @@ static unsigned long zcache_curr_objnode_count_max;
  * actually do a malloc
  */
 struct zcache_preload {
-	void *page;
+	struct zc_hdr *zh;
 	struct tmem_obj *obj;
 	int nr;
 	struct tmem_objnode *objnodes[OBJNODE_TREE_MAX_PATH];
@@ -753,14 +374,16 @@ static int zcache_do_preload(struct tmem_pool *pool)
 	struct zcache_preload *kp;
 	struct tmem_objnode *objnode;
 	struct tmem_obj *obj;
-	void *page;
+	struct zc_hdr *zh;
 	int ret = -ENOMEM;
 
 	if (unlikely(zcache_objnode_cache == NULL))
 		goto out;
 	if (unlikely(zcache_obj_cache == NULL))
 		goto out;
-	if (!spin_trylock(&zcache_direct_reclaim_lock)) {
+	if (unlikely(zcache_zhdr_cache == NULL))
+		goto out;
+	if (!read_trylock(&zcache_direct_reclaim_lock)) {
 		zcache_aborted_preload++;
 		goto out;
 	}
@@ -787,9 +410,9 @@ static int zcache_do_preload(struct tmem_pool *pool)
 		zcache_failed_alloc++;
 		goto unlock_out;
 	}
-	page = (void *)__get_free_page(ZCACHE_GFP_MASK);
-	if (unlikely(page == NULL)) {
-		zcache_failed_get_free_pages++;
+	zh = kmem_cache_alloc(zcache_zhdr_cache, ZCACHE_GFP_MASK);
+	if (unlikely(zh == NULL)) {
+		zcache_failed_alloc++;
 		kmem_cache_free(zcache_obj_cache, obj);
 		goto unlock_out;
 	}
@@ -799,32 +422,32 @@ static int zcache_do_preload(struct tmem_pool *pool)
 		kp->obj = obj;
 	else
 		kmem_cache_free(zcache_obj_cache, obj);
-	if (kp->page == NULL)
-		kp->page = page;
+	if (kp->zh == NULL)
+		kp->zh = zh;
 	else
-		free_page((unsigned long)page);
+		kmem_cache_free(zcache_zhdr_cache, zh);
 	ret = 0;
 unlock_out:
-	spin_unlock(&zcache_direct_reclaim_lock);
+	read_unlock(&zcache_direct_reclaim_lock);
 out:
 	return ret;
 }
 
-static void *zcache_get_free_page(void)
+static struct zc_hdr *zcache_get_zhdr(void)
 {
 	struct zcache_preload *kp;
-	void *page;
+	struct zc_hdr *zh;
 
 	kp = &__get_cpu_var(zcache_preloads);
-	page = kp->page;
-	BUG_ON(page == NULL);
-	kp->page = NULL;
-	return page;
+	zh = kp->zh;
+	BUG_ON(zh == NULL);
+	kp->zh = NULL;
+	return zh;
 }
 
-static void zcache_free_page(void *p)
+static void zcache_free_zhdr(struct zc_hdr *zh)
 {
-	free_page((unsigned long)p);
+	kmem_cache_free(zcache_zhdr_cache, zh);
 }
 
 /*
@@ -915,12 +538,11 @@ static void *zcache_pampd_create(struct tmem_pool *pool, struct tmem_oid *oid,
 		if (ret == 0)
 
 			goto out;
-		if (clen == 0 || clen > zbud_max_buddy_size()) {
+		if (clen == 0 || clen > zc_max_page_size) {
 			zcache_compress_poor++;
 			goto out;
 		}
-		pampd = (void *)zbud_create(pool->pool_id, oid, index,
-						page, cdata, clen);
+		pampd = (void *)zc_create(pool, oid, index, cdata, clen);
 		if (pampd != NULL) {
 			count = atomic_inc_return(&zcache_curr_eph_pampd_count);
 			if (count > zcache_curr_eph_pampd_count_max)
@@ -938,12 +560,11 @@ static void *zcache_pampd_create(struct tmem_pool *pool, struct tmem_oid *oid,
 		ret = zcache_compress(page, &cdata, &clen);
 		if (ret == 0)
 			goto out;
-		if (clen > zv_max_page_size) {
+		if (clen == 0 || clen > zc_max_page_size) {
 			zcache_compress_poor++;
 			goto out;
 		}
-		pampd = (void *)zv_create(zcache_client.xvpool, pool->pool_id,
-						oid, index, cdata, clen);
+		pampd = (void *)zc_create(pool, oid, index, cdata, clen);
 		if (pampd == NULL)
 			goto out;
 		count = atomic_inc_return(&zcache_curr_pers_pampd_count);
@@ -961,13 +582,7 @@ out:
 static int zcache_pampd_get_data(struct page *page, void *pampd,
 						struct tmem_pool *pool)
 {
-	int ret = 0;
-
-	if (is_ephemeral(pool))
-		ret = zbud_decompress(page, pampd);
-	else
-		zv_decompress(page, pampd);
-	return ret;
+	return zc_decompress(page, pool, pampd);
 }
 
 /*
@@ -976,12 +591,11 @@ static int zcache_pampd_get_data(struct page *page, void *pampd,
  */
 static void zcache_pampd_free(void *pampd, struct tmem_pool *pool)
 {
+	zc_free(pool, (struct zc_hdr *)pampd);
 	if (is_ephemeral(pool)) {
-		zbud_free_and_delist((struct zbud_hdr *)pampd);
 		atomic_dec(&zcache_curr_eph_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_eph_pampd_count) < 0);
 	} else {
-		zv_free(zcache_client.xvpool, (struct zv_hdr *)pampd);
 		atomic_dec(&zcache_curr_pers_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_pers_pampd_count) < 0);
 	}
@@ -994,13 +608,14 @@ static struct tmem_pamops zcache_pamops = {
 };
 
 /*
- * zcache compression/decompression and related per-cpu stuff
+ * zcache compression/decompression and related per-cpu stuff.  Pages are
+ * only ever compressed with irqs disabled, into the buffers of the local
+ * cpu, so there is no lock to contend on.
  */
 
 #define LZO_WORKMEM_BYTES LZO1X_1_MEM_COMPRESS
 #define LZO_DSTMEM_PAGE_ORDER 1
 static DEFINE_PER_CPU(unsigned char *, zcache_workmem);
-static DEFINE_PER_CPU(unsigned char *, zcache_dstmem);
 
 static int zcache_compress(struct page *from, void **out_va, size_t *out_len)
 {
@@ -1054,7 +669,9 @@ static int zcache_cpu_notifier(struct notifier_block *nb,
 			kp->nr--;
 		}
 		kmem_cache_free(zcache_obj_cache, kp->obj);
-		free_page((unsigned long)kp->page);
+		if (kp->zh != NULL)
+			kmem_cache_free(zcache_zhdr_cache, kp->zh);
+		kp->zh = NULL;
 		break;
 	default:
 		break;
@@ -1108,28 +725,22 @@ ZCACHE_SYSFS_RO(flobj_total);
 ZCACHE_SYSFS_RO(flobj_found);
 ZCACHE_SYSFS_RO(failed_eph_puts);
 ZCACHE_SYSFS_RO(failed_pers_puts);
-ZCACHE_SYSFS_RO(zbud_curr_zbytes);
-ZCACHE_SYSFS_RO(zbud_cumul_zpages);
-ZCACHE_SYSFS_RO(zbud_cumul_zbytes);
-ZCACHE_SYSFS_RO(zbud_buddied_count);
-ZCACHE_SYSFS_RO(zbpg_unused_list_count);
-ZCACHE_SYSFS_RO(evicted_raw_pages);
-ZCACHE_SYSFS_RO(evicted_unbuddied_pages);
-ZCACHE_SYSFS_RO(evicted_buddied_pages);
-ZCACHE_SYSFS_RO(failed_get_free_pages);
+ZCACHE_SYSFS_RO(evicted_eph_pages);
 ZCACHE_SYSFS_RO(failed_alloc);
 ZCACHE_SYSFS_RO(put_to_flush);
 ZCACHE_SYSFS_RO(aborted_preload);
 ZCACHE_SYSFS_RO(aborted_shrink);
 ZCACHE_SYSFS_RO(compress_poor);
-ZCACHE_SYSFS_RO_ATOMIC(zbud_curr_raw_pages);
-ZCACHE_SYSFS_RO_ATOMIC(zbud_curr_zpages);
+ZCACHE_SYSFS_RO_ATOMIC(eph_zpages);
+ZCACHE_SYSFS_RO_ATOMIC(pers_zpages);
 ZCACHE_SYSFS_RO_ATOMIC(curr_obj_count);
 ZCACHE_SYSFS_RO_ATOMIC(curr_objnode_count);
-ZCACHE_SYSFS_RO_CUSTOM(zbud_unbuddied_list_counts,
-			zbud_show_unbuddied_list_counts);
-ZCACHE_SYSFS_RO_CUSTOM(zbud_cumul_chunk_counts,
-			zbud_show_cumul_chunk_counts);
+ZCACHE_SYSFS_RO_CUSTOM(eph_zbytes, zc_show_eph_zbytes);
+ZCACHE_SYSFS_RO_CUSTOM(pers_zbytes, zc_show_pers_zbytes);
+ZCACHE_SYSFS_RO_CUSTOM(eph_pages, zc_show_eph_pages);
+ZCACHE_SYSFS_RO_CUSTOM(pers_pages, zc_show_pers_pages);
+ZCACHE_SYSFS_RO_CUSTOM(eph_density, zc_show_eph_density);
+ZCACHE_SYSFS_RO_CUSTOM(pers_density, zc_show_pers_density);
 
 static struct attribute *zcache_attrs[] = {
 	&zcache_curr_obj_count_attr.attr,
@@ -1143,23 +754,19 @@ static struct attribute *zcache_attrs[] = {
 	&zcache_failed_eph_puts_attr.attr,
 	&zcache_failed_pers_puts_attr.attr,
 	&zcache_compress_poor_attr.attr,
-	&zcache_zbud_curr_raw_pages_attr.attr,
-	&zcache_zbud_curr_zpages_attr.attr,
-	&zcache_zbud_curr_zbytes_attr.attr,
-	&zcache_zbud_cumul_zpages_attr.attr,
-	&zcache_zbud_cumul_zbytes_attr.attr,
-	&zcache_zbud_buddied_count_attr.attr,
-	&zcache_zbpg_unused_list_count_attr.attr,
-	&zcache_evicted_raw_pages_attr.attr,
-	&zcache_evicted_unbuddied_pages_attr.attr,
-	&zcache_evicted_buddied_pages_attr.attr,
-	&zcache_failed_get_free_pages_attr.attr,
+	&zcache_eph_zpages_attr.attr,
+	&zcache_eph_zbytes_attr.attr,
+	&zcache_eph_pages_attr.attr,
+	&zcache_eph_density_attr.attr,
+	&zcache_pers_zpages_attr.attr,
+	&zcache_pers_zbytes_attr.attr,
+	&zcache_pers_pages_attr.attr,
+	&zcache_pers_density_attr.attr,
+	&zcache_evicted_eph_pages_attr.attr,
 	&zcache_failed_alloc_attr.attr,
 	&zcache_put_to_flush_attr.attr,
 	&zcache_aborted_preload_attr.attr,
 	&zcache_aborted_shrink_attr.attr,
-	&zcache_zbud_unbuddied_list_counts_attr.attr,
-	&zcache_zbud_cumul_chunk_counts_attr.attr,
 	NULL,
 };
 
@@ -1179,7 +786,9 @@ static struct attribute_group zcache_attr_group = {
 static bool zcache_freeze;
 
 /*
- * zcache shrinker interface (only useful for ephemeral pages, so zbud only)
+ * zcache shrinker interface (only useful for ephemeral pages).  Evicted
+ * pages leave holes in their zspages, which zsmalloc's own shrinker
+ * compacts into free pages.
  */
 static int shrink_zcache_memory(struct shrinker *shrink,
 				struct shrink_control *sc)
@@ -1192,13 +801,13 @@ static int shrink_zcache_memory(struct shrinker *shrink,
 		if (!(gfp_mask & __GFP_FS))
 			/* does this case really need to be skipped? */
 			goto out;
-		if (spin_trylock(&zcache_direct_reclaim_lock)) {
-			zbud_evict_pages(nr);
-			spin_unlock(&zcache_direct_reclaim_lock);
+		if (write_trylock(&zcache_direct_reclaim_lock)) {
+			zc_evict_pages(nr);
+			write_unlock(&zcache_direct_reclaim_lock);
 		} else
 			zcache_aborted_shrink++;
 	}
-	ret = (int)atomic_read(&zcache_zbud_curr_raw_pages);
+	ret = (int)(atomic_long_read(&zcache_eph_zbytes) >> PAGE_SHIFT);
 out:
 	return ret;
 }
@@ -1624,16 +1233,22 @@ static int __init zcache_init(void)
 				sizeof(struct tmem_objnode), 0, 0, NULL);
 	zcache_obj_cache = kmem_cache_create("zcache_obj",
 				sizeof(struct tmem_obj), 0, 0, NULL);
+	zcache_zhdr_cache = kmem_cache_create("zcache_zhdr",
+				sizeof(struct zc_hdr), 0, 0, NULL);
 #endif
 #ifdef CONFIG_CLEANCACHE
 	if (zcache_enabled && use_cleancache) {
 		struct cleancache_ops old_ops;
 
-		zbud_init();
+		zcache_eph_zspool = zs_create_pool("zcache_eph");
+		if (zcache_eph_zspool == NULL) {
+			pr_err("zcache: can't create ephemeral zspool\n");
+			goto out;
+		}
 		register_shrinker(&zcache_shrinker);
 		old_ops = zcache_cleancache_register_ops();
 		pr_info("zcache: cleancache enabled using kernel "
-			"transcendent memory and compression buddies\n");
+			"transcendent memory and zsmalloc\n");
 		if (old_ops.init_fs != NULL)
 			pr_warning("zcache: cleancache_ops overridden");
 	}
@@ -1642,14 +1257,14 @@ static int __init zcache_init(void)
 	if (zcache_enabled && use_frontswap) {
 		struct frontswap_ops old_ops;
 
-		zcache_client.xvpool = xv_create_pool();
-		if (zcache_client.xvpool == NULL) {
-			pr_err("zcache: can't create xvpool\n");
+		zcache_pers_zspool = zs_create_pool("zcache_pers");
+		if (zcache_pers_zspool == NULL) {
+			pr_err("zcache: can't create persistent zspool\n");
 			goto out;
 		}
 		old_ops = zcache_frontswap_register_ops();
 		pr_info("zcache: frontswap enabled using kernel "
-			"transcendent memory and xvmalloc\n");
+			"transcendent memory and zsmalloc\n");
 		if (old_ops.init != NULL)
 			pr_warning("ktmem: frontswap_ops overridden");
 	}
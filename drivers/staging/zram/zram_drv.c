@@ -23,15 +23,21 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/crypto.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
+#include <linux/hash.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -42,14 +48,14 @@ struct zram *devices;
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
@@ -89,18 +95,314 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * The table entry of a page, and the object it points to, may only be
+ * looked at or changed with the slot locked.
+ */
+static void zram_lock_slot(struct zram *zram, u32 index)
+{
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].flags);
+}
+
+static void zram_unlock_slot(struct zram *zram, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].flags);
+}
+
+/*
+ * Get an idle compression stream, waiting for a writer on another CPU to
+ * put one back if they are all busy.
+ */
+static struct zram_stream *zram_stream_get(struct zram *zram)
+{
+	struct zram_stream *strm;
+
+	for (;;) {
+		spin_lock(&zram->stream_lock);
+		if (!list_empty(&zram->streams)) {
+			strm = list_first_entry(&zram->streams,
+					struct zram_stream, list);
+			list_del(&strm->list);
+			spin_unlock(&zram->stream_lock);
+			return strm;
+		}
+		spin_unlock(&zram->stream_lock);
+
+		wait_event(zram->stream_wait, !list_empty(&zram->streams));
+	}
+}
+
+static void zram_stream_put(struct zram *zram, struct zram_stream *strm)
+{
+	spin_lock(&zram->stream_lock);
+	list_add(&strm->list, &zram->streams);
+	spin_unlock(&zram->stream_lock);
+
+	wake_up(&zram->stream_wait);
+}
+
+static void zram_destroy_streams(struct zram *zram)
+{
+	struct zram_stream *strm, *next;
+
+	list_for_each_entry_safe(strm, next, &zram->streams, list) {
+		list_del(&strm->list);
+		if (strm->tfm)
+			crypto_free_comp(strm->tfm);
+		free_pages((unsigned long)strm->buffer, 1);
+		kfree(strm);
+	}
+}
+
+/*
+ * One stream per possible CPU rather than per online one: the pool is sized
+ * once, and a device set up while a core is unplugged must still be able to
+ * compress on every core once it comes back.
+ */
+static int zram_create_streams(struct zram *zram)
+{
+	struct zram_stream *strm;
+	int i;
+
+	for (i = 0; i < num_possible_cpus(); i++) {
+		strm = kzalloc(sizeof(*strm), GFP_KERNEL);
+		if (!strm)
+			return -ENOMEM;
+
+		list_add(&strm->list, &zram->streams);
+
+		strm->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+		if (!strm->buffer)
+			return -ENOMEM;
+
+		strm->tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+		if (IS_ERR(strm->tfm)) {
+			int ret = PTR_ERR(strm->tfm);
+
+			strm->tfm = NULL;
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int zram_compress(struct zram *zram, struct zram_stream *strm,
+			const unsigned char *src, unsigned int *clen)
+{
+	ktime_t start = ktime_get();
+	int ret;
+
+	*clen = 2 * PAGE_SIZE;
+	ret = crypto_comp_compress(strm->tfm, src, PAGE_SIZE,
+				strm->buffer, clen);
+	if (ret)
+		return ret;
+
+	spin_lock(&zram->stat64_lock);
+	zram->stats.compr_calls++;
+	zram->stats.compr_bytes += *clen;
+	zram->stats.compr_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	spin_unlock(&zram->stat64_lock);
+
+	return 0;
+}
+
+static int zram_decompress(struct zram *zram, struct zram_stream *strm,
+			unsigned int clen, unsigned char *dst)
+{
+	ktime_t start = ktime_get();
+	unsigned int dlen = PAGE_SIZE;
+	int ret;
+
+	ret = crypto_comp_decompress(strm->tfm, strm->buffer, clen,
+				dst, &dlen);
+	if (ret)
+		return ret;
+	if (dlen != PAGE_SIZE)
+		return -EIO;
+
+	spin_lock(&zram->stat64_lock);
+	zram->stats.decompr_calls++;
+	zram->stats.decompr_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	spin_unlock(&zram->stat64_lock);
+
+	return 0;
+}
+
+static unsigned long zram_alloc_block(struct zram *zram)
+{
+	unsigned long block;
+
+	do {
+		block = find_first_zero_bit(zram->bitmap, zram->nr_blocks);
+		if (block >= zram->nr_blocks)
+			return ULONG_MAX;
+	} while (test_and_set_bit(block, zram->bitmap));
+
+	return block;
+}
+
+static void zram_free_block(struct zram *zram, unsigned long block)
+{
+	clear_bit(block, zram->bitmap);
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * Synchronous page I/O on the backing device. This must not be called
+ * from zram_make_request(), since bios submitted from there are only
+ * issued once it returns: see zram_bdev_read().
+ */
+static int zram_bdev_rw(struct zram *zram, int rw, unsigned long block,
+			struct page *page)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = block << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = &done;
+	bio_add_page(bio, page, PAGE_SIZE, 0);
+
+	submit_bio(rw | REQ_SYNC, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	if (!ret)
+		zram_stat64_inc(zram, rw == WRITE ? &zram->stats.bd_writes :
+					&zram->stats.bd_reads);
+	return ret;
+}
+
+struct zram_bdev_work {
+	struct work_struct work;
+	struct zram *zram;
+	unsigned long block;
+	struct page *page;
+	int ret;
+};
+
+static void zram_bdev_read_work(struct work_struct *work)
+{
+	struct zram_bdev_work *zw = container_of(work,
+					struct zram_bdev_work, work);
+
+	zw->ret = zram_bdev_rw(zw->zram, READ, zw->block, zw->page);
+}
+
+/* Reads a written back page, from a worker for the reason given above */
+static int zram_bdev_read(struct zram *zram, unsigned long block,
+			struct page *page)
+{
+	struct zram_bdev_work zw;
+
+	zw.zram = zram;
+	zw.block = block;
+	zw.page = page;
+
+	INIT_WORK_ONSTACK(&zw.work, zram_bdev_read_work);
+	queue_work(system_unbound_wq, &zw.work);
+	flush_work(&zw.work);
+	destroy_work_on_stack(&zw.work);
+
+	return zw.ret;
+}
+
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
+	return 1;
+}
+
+/*
+ * zram_dedup_get - looks for an object holding the same compressed data
+ * as the stream buffer, and takes a reference to it if there is one.
+ */
+static struct zram_dedup *zram_dedup_get(struct zram *zram,
+			struct zram_stream *strm, unsigned int clen, u32 checksum)
+{
+	struct hlist_head *head;
+	struct hlist_node *node;
+	struct zram_dedup *entry;
+
+	head = &zram->dedup_hash[hash_32(checksum, ZRAM_DEDUP_HASH_BITS)];
+
+	spin_lock(&zram->dedup_lock);
+	hlist_for_each_entry(entry, node, head, node) {
+		if (entry->checksum != checksum || entry->clen != clen)
+			continue;
+
+		if (!zs_compare(zram->mem_pool, entry->handle,
+				strm->buffer, clen)) {
+			entry->refcount++;
+			spin_unlock(&zram->dedup_lock);
+			return entry;
+		}
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	return NULL;
+}
+
+static struct zram_dedup *zram_dedup_add(struct zram *zram,
+			unsigned long handle, unsigned int clen, u32 checksum)
+{
+	struct zram_dedup *entry;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	entry->checksum = checksum;
+	entry->clen = clen;
+	entry->handle = handle;
+	entry->refcount = 1;
+
+	spin_lock(&zram->dedup_lock);
+	hlist_add_head(&entry->node,
+		&zram->dedup_hash[hash_32(checksum, ZRAM_DEDUP_HASH_BITS)]);
+	spin_unlock(&zram->dedup_lock);
+
+	return entry;
+}
+
+/* Returns 1 if that was the last reference and 'entry' is gone */
+static int zram_dedup_put(struct zram *zram, struct zram_dedup *entry)
+{
+	spin_lock(&zram->dedup_lock);
+	if (--entry->refcount) {
+		spin_unlock(&zram->dedup_lock);
+		return 0;
+	}
+	hlist_del(&entry->node);
+	spin_unlock(&zram->dedup_lock);
+
+	zs_free(zram->mem_pool, entry->handle);
+	kfree(entry);
+
 	return 1;
 }
 
@@ -133,39 +435,65 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+/* Called with the slot locked */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
+	unsigned long handle = zram->table[index].handle;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
 
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
+	/* No memory is allocated for single pattern pages */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (zram->table[index].element)
+			zram_stat_dec(&zram->stats.pages_same);
+		else
 			zram_stat_dec(&zram->stats.pages_zero);
-		}
+		zram->table[index].element = 0;
 		return;
 	}
 
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_free_block(zram, zram->table[index].block);
+		zram_stat_dec(&zram->stats.pages_wb);
+		zram_stat_dec(&zram->stats.pages_stored);
+		zram->table[index].block = 0;
+		return;
+	}
+
+	if (unlikely(!handle))
+		return;
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page(zram->table[index].page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		struct zram_dedup *entry = zram->table[index].entry;
+
+		clen = entry->clen;
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+		if (clen <= PAGE_SIZE / 2)
+			zram_stat_dec(&zram->stats.good_compress);
+		if (zram_dedup_put(zram, entry))
+			goto out;
+
+		/* Someone else still holds the object */
+		zram_stat_dec(&zram->stats.pages_dup);
+		zram_stat_dec(&zram->stats.pages_stored);
+		zram->table[index].handle = 0;
+		return;
+	}
 
-	xv_free(zram->mem_pool, page, offset);
+	clen = zram->table[index].size;
+	zs_free(zram->mem_pool, handle);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
@@ -173,16 +501,24 @@ out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
-static void handle_zero_page(struct page *page)
+static void handle_same_page(struct page *page, unsigned long element)
 {
 	void *user_mem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem, 0, PAGE_SIZE);
+	if (element) {
+		unsigned long *p = user_mem;
+		unsigned int pos;
+
+		for (pos = 0; pos != PAGE_SIZE / sizeof(*p); pos++)
+			p[pos] = element;
+	} else {
+		memset(user_mem, 0, PAGE_SIZE);
+	}
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -194,8 +530,7 @@ static void handle_uncompressed_page(struct zram *zram,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -204,219 +539,536 @@ static void handle_uncompressed_page(struct zram *zram,
 	flush_dcache_page(page);
 }
 
-static void zram_read(struct zram *zram, struct bio *bio)
+static int zram_read_page(struct zram *zram, struct zram_stream *strm,
+			struct page *page, u32 index)
 {
+	int ret;
+	unsigned int clen;
+	unsigned long handle;
+	unsigned char *user_mem;
 
-	int i;
-	u32 index;
-	struct bio_vec *bvec;
+	zram_lock_slot(zram, index);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
 
-	zram_stat64_inc(zram, &zram->stats.num_reads);
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		unsigned long element = zram->table[index].element;
 
-	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		size_t clen;
-		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
+		zram_unlock_slot(zram, index);
+		handle_same_page(page, element);
+		return 0;
+	}
 
-		page = bvec->bv_page;
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		unsigned long block = zram->table[index].block;
 
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
-			index++;
-			continue;
+		zram_unlock_slot(zram, index);
+		ret = zram_bdev_read(zram, block, page);
+		if (unlikely(ret)) {
+			pr_err("Backing device read failed! err=%d, "
+				"page=%u\n", ret, index);
+			return ret;
 		}
+		flush_dcache_page(page);
+		return 0;
+	}
 
-		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
-			pr_debug("Read before write: sector=%lu, size=%u",
-				(ulong)(bio->bi_sector), bio->bi_size);
-			handle_zero_page(page);
-			index++;
-			continue;
+	/* Requested page is not present in compressed area */
+	if (unlikely(!zram->table[index].handle)) {
+		zram_unlock_slot(zram, index);
+		pr_debug("Read before write: page=%u\n", index);
+		handle_same_page(page, 0);
+		return 0;
+	}
+
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		handle_uncompressed_page(zram, page, index);
+		zram_unlock_slot(zram, index);
+		return 0;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		handle = zram->table[index].entry->handle;
+		clen = zram->table[index].entry->clen;
+	} else {
+		handle = zram->table[index].handle;
+		clen = zram->table[index].size;
+	}
+
+	/*
+	 * Take a copy of the object so that the slot is not held
+	 * locked while decompressing.
+	 */
+	zs_read(zram->mem_pool, handle, strm->buffer, clen);
+	zram_unlock_slot(zram, index);
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	ret = zram_decompress(zram, strm, clen, user_mem);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n",
+			ret, index);
+		return ret;
+	}
+
+	flush_dcache_page(page);
+	return 0;
+}
+
+/*
+ * Pages are compressed with one of the device's streams, and the result
+ * copied to its own allocation, without holding any lock on the table.
+ * The slot is only locked to swap the old object for the new one, so
+ * writers on different CPUs run in parallel.
+ *
+ * With dedup enabled, a page whose compressed data is already stored for
+ * another page just takes a reference to that object.
+ */
+static int zram_write_page(struct zram *zram, struct zram_stream *strm,
+			struct page *page, u32 index)
+{
+	int ret;
+	u32 checksum = 0;
+	unsigned int clen;
+	unsigned long element;
+	unsigned long handle = 0;
+	int uncompressed = 0;
+	struct zram_dedup *entry = NULL;
+	struct page *page_store;
+	unsigned char *user_mem, *src = strm->buffer;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	if (page_same_filled(user_mem, &element)) {
+		kunmap_atomic(user_mem, KM_USER0);
+
+		/*
+		 * System overwrites unused sectors. Free memory
+		 * associated with this sector now.
+		 */
+		zram_lock_slot(zram, index);
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram->table[index].element = element;
+		zram_unlock_slot(zram, index);
+		if (element)
+			zram_stat_inc(&zram->stats.pages_same);
+		else
+			zram_stat_inc(&zram->stats.pages_zero);
+		return 0;
+	}
+
+	ret = zram_compress(zram, strm, user_mem, &clen);
+
+	kunmap_atomic(user_mem, KM_USER0);
+
+	if (unlikely(ret)) {
+		pr_err("Compression failed! err=%d\n", ret);
+		return ret;
+	}
+
+	/*
+	 * Page is incompressible. Store it as-is (uncompressed)
+	 * since we do not want to return too many disk write
+	 * errors which has side effect of hanging the system.
+	 */
+	if (unlikely(clen > max_zpage_size)) {
+		clen = PAGE_SIZE;
+		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (unlikely(!page_store)) {
+			pr_info("Error allocating memory for "
+				"incompressible page: %u\n", index);
+			return -ENOMEM;
 		}
 
-		/* Page is stored uncompressed since it's incompressible */
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-			handle_uncompressed_page(zram, page, index);
-			index++;
-			continue;
+		copy_highpage(page_store, page);
+		uncompressed = 1;
+		handle = (unsigned long)page_store;
+		goto store;
+	}
+
+	if (zram->dedup) {
+		checksum = jhash(src, clen, 0);
+		entry = zram_dedup_get(zram, strm, clen, checksum);
+		if (entry) {
+			zram_stat_inc(&zram->stats.pages_dup);
+			goto update;
 		}
+	}
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
+	handle = zs_malloc(zram->mem_pool, clen, GFP_NOIO | __GFP_HIGHMEM);
+	if (!handle) {
+		pr_info("Error allocating memory for compressed "
+			"page: %u, size=%u\n", index, clen);
+		return -ENOMEM;
+	}
+
+	zs_write(zram->mem_pool, handle, src, clen);
+
+	/* Objects that cannot be tracked are just not shared */
+	if (zram->dedup)
+		entry = zram_dedup_add(zram, handle, clen, checksum);
+
+store:
+	zram_stat64_add(zram, &zram->stats.compr_size, clen);
+
+update:
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	zram_lock_slot(zram, index);
+	zram_free_page(zram, index);
+	if (entry) {
+		zram->table[index].entry = entry;
+		zram_set_flag(zram, index, ZRAM_DEDUP);
+	} else {
+		zram->table[index].handle = handle;
+		zram->table[index].size = clen;
+	}
+	if (unlikely(uncompressed))
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+	zram_unlock_slot(zram, index);
+
+	/* Update stats */
+	if (unlikely(uncompressed))
+		zram_stat_inc(&zram->stats.pages_expand);
+	zram_stat_inc(&zram->stats.pages_stored);
+	if (clen <= PAGE_SIZE / 2)
+		zram_stat_inc(&zram->stats.good_compress);
+
+	return 0;
+}
+
+static inline int is_partial_io(struct bio_vec *bvec)
+{
+	return bvec->bv_len != PAGE_SIZE;
+}
+
+/*
+ * A bio_vec covers at most one zram page, starting at @offset into it.
+ * Partial pages are read whole into a bounce page, and written back by
+ * read-modify-write.
+ */
+static int zram_bvec_read(struct zram *zram, struct zram_stream *strm,
+			struct bio_vec *bvec, u32 index, int offset)
+{
+	int ret;
+	struct page *page;
+	unsigned char *user_mem;
+
+	if (!is_partial_io(bvec))
+		return zram_read_page(zram, strm, bvec->bv_page, index);
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
 
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+	ret = zram_read_page(zram, strm, page, index);
+	if (!ret) {
+		user_mem = kmap_atomic(bvec->bv_page, KM_USER0);
+		memcpy(user_mem + bvec->bv_offset, page_address(page) + offset,
+			bvec->bv_len);
+		kunmap_atomic(user_mem, KM_USER0);
+		flush_dcache_page(bvec->bv_page);
+	}
 
+	__free_page(page);
+	return ret;
+}
+
+static int zram_bvec_write(struct zram *zram, struct zram_stream *strm,
+			struct bio_vec *bvec, u32 index, int offset)
+{
+	int ret;
+	struct page *page;
+	unsigned char *user_mem;
+
+	if (!is_partial_io(bvec))
+		return zram_write_page(zram, strm, bvec->bv_page, index);
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_read_page(zram, strm, page, index);
+	if (!ret) {
+		user_mem = kmap_atomic(bvec->bv_page, KM_USER0);
+		memcpy(page_address(page) + offset, user_mem + bvec->bv_offset,
+			bvec->bv_len);
 		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+		ret = zram_write_page(zram, strm, page, index);
+	}
 
-		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
-			pr_err("Decompression failed! err=%d, page=%u\n",
-				ret, index);
+	__free_page(page);
+	return ret;
+}
+
+static int zram_bvec_rw(struct zram *zram, struct zram_stream *strm,
+			struct bio_vec *bvec, u32 index, int offset, int rw)
+{
+	int ret;
+
+	if (rw == READ) {
+		ret = zram_bvec_read(zram, strm, bvec, index, offset);
+		if (unlikely(ret))
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
-			goto out;
-		}
+	} else {
+		ret = zram_bvec_write(zram, strm, bvec, index, offset);
+		if (unlikely(ret))
+			zram_stat64_inc(zram, &zram->stats.failed_writes);
+	}
 
-		flush_dcache_page(page);
+	return ret;
+}
+
+/*
+ * Frees the pages a discard request fully covers. Partially covered
+ * pages at either end are left alone, their data is still live.
+ */
+static void zram_bio_discard(struct zram *zram, u32 index, int offset,
+			struct bio *bio)
+{
+	size_t n = bio->bi_size;
+
+	if (offset) {
+		if (n <= PAGE_SIZE - offset)
+			return;
+
+		n -= PAGE_SIZE - offset;
 		index++;
 	}
 
-	set_bit(BIO_UPTODATE, &bio->bi_flags);
-	bio_endio(bio, 0);
-	return;
+	while (n >= PAGE_SIZE) {
+		zram_lock_slot(zram, index);
+		zram_free_page(zram, index);
+		zram_unlock_slot(zram, index);
+		zram_stat64_inc(zram, &zram->stats.discard);
+		index++;
+		n -= PAGE_SIZE;
+	}
+}
 
-out:
-	bio_io_error(bio);
+static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
+{
+	if (*offset + bvec->bv_len >= PAGE_SIZE)
+		(*index)++;
+	*offset = (*offset + bvec->bv_len) % PAGE_SIZE;
 }
 
-static void zram_write(struct zram *zram, struct bio *bio)
+/*
+ * All segments of a bio are handled with the same compression stream,
+ * taken once for the whole request.
+ */
+static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 {
-	int i;
+	int i, offset;
 	u32 index;
 	struct bio_vec *bvec;
+	struct zram_stream *strm;
 
-	zram_stat64_inc(zram, &zram->stats.num_writes);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	offset = (bio->bi_sector & (SECTORS_PER_PAGE - 1)) << SECTOR_SHIFT;
 
-	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		u32 offset;
-		size_t clen;
-		struct zobj_header *zheader;
-		struct page *page, *page_store;
-		unsigned char *user_mem, *cmem, *src;
+	if (unlikely(bio->bi_rw & REQ_DISCARD)) {
+		zram_bio_discard(zram, index, offset, bio);
+		bio_endio(bio, 0);
+		return;
+	}
 
-		page = bvec->bv_page;
-		src = zram->compress_buffer;
+	if (rw == READ)
+		zram_stat64_inc(zram, &zram->stats.num_reads);
+	else
+		zram_stat64_inc(zram, &zram->stats.num_writes);
 
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
+	strm = zram_stream_get(zram);
 
-		mutex_lock(&zram->lock);
+	bio_for_each_segment(bvec, bio, i) {
+		int max_transfer_size = PAGE_SIZE - offset;
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
-			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
-			index++;
-			continue;
-		}
+		if (bvec->bv_len > max_transfer_size) {
+			/*
+			 * zram_bvec_rw() can only operate on a single
+			 * zram page. Split the bio vector.
+			 */
+			struct bio_vec bv;
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+			bv.bv_page = bvec->bv_page;
+			bv.bv_len = max_transfer_size;
+			bv.bv_offset = bvec->bv_offset;
 
-		kunmap_atomic(user_mem, KM_USER0);
+			if (zram_bvec_rw(zram, strm, &bv, index, offset, rw))
+				goto out;
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
-			pr_err("Compression failed! err=%d\n", ret);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
+			bv.bv_len = bvec->bv_len - max_transfer_size;
+			bv.bv_offset += max_transfer_size;
+			if (zram_bvec_rw(zram, strm, &bv, index + 1, 0, rw))
+				goto out;
+		} else if (zram_bvec_rw(zram, strm, bvec, index, offset, rw)) {
 			goto out;
 		}
 
-		/*
-		 * Page is incompressible. Store it as-is (uncompressed)
-		 * since we do not want to return too many disk write
-		 * errors which has side effect of hanging the system.
-		 */
-		if (unlikely(clen > max_zpage_size)) {
-			clen = PAGE_SIZE;
-			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
-				pr_info("Error allocating memory for "
-					"incompressible page: %u\n", index);
-				zram_stat64_inc(zram,
-					&zram->stats.failed_writes);
-				goto out;
-			}
-
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
-		}
+		update_position(&index, &offset, bvec);
+	}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
-			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
+	zram_stream_put(zram, strm);
+	set_bit(BIO_UPTODATE, &bio->bi_flags);
+	bio_endio(bio, 0);
+	return;
+
+out:
+	zram_stream_put(zram, strm);
+	bio_io_error(bio);
+}
+
+/*
+ * zram_mark_idle - marks all pages held in memory as idle. Those still
+ * idle when zram_writeback() runs in ZRAM_WB_IDLE mode are written back.
+ */
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done)
+		goto out;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		zram_lock_slot(zram, index);
+		if (zram->table[index].handle &&
+		    !zram_test_flag(zram, index, ZRAM_SAME) &&
+		    !zram_test_flag(zram, index, ZRAM_WB))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		zram_unlock_slot(zram, index);
+	}
+out:
+	mutex_unlock(&zram->init_lock);
+}
+
+/*
+ * zram_writeback - moves pages from memory to the backing device.
+ *
+ * Each page is copied out and flagged ZRAM_UNDER_WB under its slot lock,
+ * then written with the slot unlocked. If it was freed or rewritten in
+ * the meantime, which clears that flag, the block is dropped; otherwise
+ * the in-memory copy is freed and the slot points to the block.
+ * Pages sharing a dedup object stay in memory.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	struct zram_stream *strm = NULL;
+	struct page *page;
+	size_t index;
+	int ret = 0;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done || !zram->bdev) {
+		ret = -EINVAL;
+		goto out;
+	}
+	strm = zram_stream_get(zram);
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		unsigned long block;
+		unsigned int clen = 0;
+		void *user_mem;
+
+		zram_lock_slot(zram, index);
+		if (!zram->table[index].handle ||
+		    zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_DEDUP) ||
+		    zram_test_flag(zram, index, ZRAM_WB) ||
+		    zram_test_flag(zram, index, ZRAM_UNDER_WB) ||
+		    (mode == ZRAM_WB_HUGE &&
+		     !zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) ||
+		    (mode == ZRAM_WB_IDLE &&
+		     !zram_test_flag(zram, index, ZRAM_IDLE))) {
+			zram_unlock_slot(zram, index);
+			continue;
 		}
 
-memstore:
-		zram->table[index].offset = offset;
+		if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+			copy_highpage(page, zram->table[index].page);
+		} else {
+			clen = zram->table[index].size;
+			zs_read(zram->mem_pool, zram->table[index].handle,
+				strm->buffer, clen);
+		}
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		zram_unlock_slot(zram, index);
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		if (clen) {
+			user_mem = kmap_atomic(page, KM_USER0);
+			ret = zram_decompress(zram, strm, clen, user_mem);
+			kunmap_atomic(user_mem, KM_USER0);
+			if (ret)
+				goto abort;
+		}
 
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
+		block = zram_alloc_block(zram);
+		if (block == ULONG_MAX) {
+			ret = -ENOSPC;
+			goto abort;
 		}
-#endif
 
-		memcpy(cmem, src, clen);
+		ret = zram_bdev_rw(zram, WRITE, block, page);
+		if (ret) {
+			zram_free_block(zram, block);
+			goto abort;
+		}
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+		zram_lock_slot(zram, index);
+		if (!zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_unlock_slot(zram, index);
+			zram_free_block(zram, block);
+			continue;
+		}
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram->table[index].block = block;
+		zram_unlock_slot(zram, index);
 
-		/* Update stats */
-		zram_stat64_add(zram, &zram->stats.compr_size, clen);
+		zram_stat_inc(&zram->stats.pages_wb);
 		zram_stat_inc(&zram->stats.pages_stored);
-		if (clen <= PAGE_SIZE / 2)
-			zram_stat_inc(&zram->stats.good_compress);
-
-		mutex_unlock(&zram->lock);
-		index++;
+		cond_resched();
 	}
+	goto out;
 
-	set_bit(BIO_UPTODATE, &bio->bi_flags);
-	bio_endio(bio, 0);
-	return;
-
+abort:
+	zram_lock_slot(zram, index);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_unlock_slot(zram, index);
 out:
-	bio_io_error(bio);
+	if (strm)
+		zram_stream_put(zram, strm);
+	mutex_unlock(&zram->init_lock);
+	__free_page(page);
+	return ret;
 }
 
 /*
- * Check if request is within bounds and page aligned.
+ * Check if request is within bounds and aligned on zram logical blocks.
  */
 static inline int valid_io_request(struct zram *zram, struct bio *bio)
 {
-	if (unlikely(
-		(bio->bi_sector >= (zram->disksize >> SECTOR_SHIFT)) ||
-		(bio->bi_sector & (SECTORS_PER_PAGE - 1)) ||
-		(bio->bi_size & (PAGE_SIZE - 1)))) {
+	u64 start, end, bound;
 
+	if (unlikely(bio->bi_sector & (ZRAM_SECTOR_PER_LOGICAL_BLOCK - 1)))
+		return 0;
+	if (unlikely(bio->bi_size & (ZRAM_LOGICAL_BLOCK_SIZE - 1)))
+		return 0;
+
+	start = bio->bi_sector;
+	end = start + (bio->bi_size >> SECTOR_SHIFT);
+	bound = zram->disksize >> SECTOR_SHIFT;
+	/* out of range */
+	if (unlikely(start >= bound || end > bound || start > end))
 		return 0;
-	}
 
 	/* I/O request is valid */
 	return 1;
@@ -440,17 +1092,61 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 		return 0;
 	}
 
-	switch (bio_data_dir(bio)) {
-	case READ:
-		zram_read(zram, bio);
-		break;
+	__zram_make_request(zram, bio, bio_data_dir(bio));
 
-	case WRITE:
-		zram_write(zram, bio);
-		break;
+	return 0;
+}
+
+static void zram_reset_backing_dev(struct zram *zram)
+{
+	if (zram->bdev)
+		blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	zram->bdev = NULL;
+
+	kfree(zram->backing_dev);
+	zram->backing_dev = NULL;
+
+	vfree(zram->bitmap);
+	zram->bitmap = NULL;
+	zram->nr_blocks = 0;
+}
+
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	struct block_device *bdev;
+	unsigned long nr_blocks;
+	int ret = 0;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		ret = -EBUSY;
+		goto out;
 	}
 
-	return 0;
+	zram_reset_backing_dev(zram);
+
+	bdev = blkdev_get_by_path(path, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				zram);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		goto out;
+	}
+	zram->bdev = bdev;
+
+	nr_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	zram->bitmap = vzalloc(BITS_TO_LONGS(nr_blocks) * sizeof(long));
+	zram->backing_dev = kstrdup(path, GFP_KERNEL);
+	if (!nr_blocks || !zram->bitmap || !zram->backing_dev) {
+		zram_reset_backing_dev(zram);
+		ret = nr_blocks ? -ENOMEM : -EINVAL;
+		goto out;
+	}
+	zram->nr_blocks = nr_blocks;
+
+	pr_info("Using %s as backing device, %lu pages\n", path, nr_blocks);
+out:
+	mutex_unlock(&zram->init_lock);
+	return ret;
 }
 
 void zram_reset_device(struct zram *zram)
@@ -461,33 +1157,25 @@ void zram_reset_device(struct zram *zram)
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	zram_destroy_streams(zram);
 
-	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
-			continue;
-
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
-	}
+	/*
+	 * Free all pages that are still in this zram device. There is no
+	 * table yet if zram_init_device() failed before allocating it.
+	 */
+	if (zram->table)
+		for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++)
+			zram_free_page(zram, index);
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	kfree(zram->dedup_hash);
+	zram->dedup_hash = NULL;
+
+	zram_reset_backing_dev(zram);
+
+	zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -511,17 +1199,10 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_create_streams(zram);
+	if (ret) {
+		pr_err("Error allocating %s compression streams\n",
+			zram->compressor);
 		goto fail;
 	}
 
@@ -535,12 +1216,20 @@ int zram_init_device(struct zram *zram)
 		goto fail;
 	}
 
+	zram->dedup_hash = kcalloc(1 << ZRAM_DEDUP_HASH_BITS,
+				sizeof(*zram->dedup_hash), GFP_KERNEL);
+	if (!zram->dedup_hash) {
+		pr_err("Error allocating dedup hash table\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -566,7 +1255,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_lock_slot(zram, index);
 	zram_free_page(zram, index);
+	zram_unlock_slot(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -579,9 +1270,14 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	INIT_LIST_HEAD(&zram->streams);
+	spin_lock_init(&zram->stream_lock);
+	init_waitqueue_head(&zram->stream_wait);
+	spin_lock_init(&zram->dedup_lock);
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -615,8 +1311,8 @@ static int create_device(struct zram *zram, int device_id)
 	set_capacity(zram->disk, 0);
 
 	/*
-	 * To ensure that we always get PAGE_SIZE aligned
-	 * and n*PAGE_SIZED sized I/O requests.
+	 * Requests are aligned on ZRAM_LOGICAL_BLOCK_SIZE. Segments that
+	 * do not cover a whole page are handled by zram_bvec_rw().
 	 */
 	blk_queue_physical_block_size(zram->disk->queue, PAGE_SIZE);
 	blk_queue_logical_block_size(zram->disk->queue,
@@ -624,6 +1320,16 @@ static int create_device(struct zram *zram, int device_id)
 	blk_queue_io_min(zram->disk->queue, PAGE_SIZE);
 	blk_queue_io_opt(zram->disk->queue, PAGE_SIZE);
 
+	/* Discarding a page frees its memory, like swap_slot_free_notify */
+	zram->disk->queue->limits.discard_granularity = PAGE_SIZE;
+	zram->disk->queue->limits.max_discard_sectors = UINT_MAX;
+	/*
+	 * Discarded pages read back as zeroes, but partially discarded
+	 * ones keep their data.
+	 */
+	zram->disk->queue->limits.discard_zeroes_data = 0;
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, zram->disk->queue);
+
 	add_disk(zram->disk);
 
 	ret = sysfs_create_group(&disk_to_dev(zram->disk)->kobj,
@@ -713,6 +1419,8 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		else
+			zram_reset_backing_dev(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
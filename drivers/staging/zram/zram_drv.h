@@ -17,8 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/crypto.h>
+#include <linux/list.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,23 +29,14 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Default compressor, see comp_algorithm in zram_sysfs.c for the others */
+static const char default_compressor[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -50,9 +44,8 @@ static const unsigned default_disksize_perc_ram = 25;
 static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
- * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ * NOTE: max_zpage_size must be less than or equal to ZS_MAX_OBJ_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -61,28 +54,76 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 #define SECTOR_SIZE		(1 << SECTOR_SHIFT)
 #define SECTORS_PER_PAGE_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
 #define SECTORS_PER_PAGE	(1 << SECTORS_PER_PAGE_SHIFT)
-#define ZRAM_LOGICAL_BLOCK_SIZE	4096
+#define ZRAM_LOGICAL_BLOCK_SHIFT	12
+#define ZRAM_LOGICAL_BLOCK_SIZE	(1 << ZRAM_LOGICAL_BLOCK_SHIFT)
+#define ZRAM_SECTOR_PER_LOGICAL_BLOCK	\
+	(1 << (ZRAM_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT))
+
+#define ZRAM_DEDUP_HASH_BITS	12
 
 /* Flags for zram pages (table[page_no].flags) */
 enum zram_pageflags {
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page consists of one machine word repeated (zeros included) */
+	ZRAM_SAME,
+
+	/* Page shares a compressed object with identical pages */
+	ZRAM_DEDUP,
+
+	/* Page was written back to the backing device */
+	ZRAM_WB,
+
+	/* Page is being written back */
+	ZRAM_UNDER_WB,
+
+	/* Page was not accessed since the last "idle" marking */
+	ZRAM_IDLE,
+
+	/* Bit spinlock serializing all access to the table entry */
+	ZRAM_ACCESS,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
+/*
+ * Compressed object shared by all pages whose compressed data is the
+ * same. Found through zram->dedup_hash by a checksum of that data.
+ */
+struct zram_dedup {
+	struct hlist_node node;
+	u32 checksum;
+	u16 clen;
+	unsigned long handle;
+	int refcount;		/* no. of table entries using it */
+};
+
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	union {
+		unsigned long handle;		/* zsmalloc object */
+		struct page *page;		/* if ZRAM_UNCOMPRESSED */
+		struct zram_dedup *entry;	/* if ZRAM_DEDUP */
+		unsigned long element;		/* if ZRAM_SAME */
+		unsigned long block;		/* if ZRAM_WB */
+	};
+	u16 size;	/* compressed size, if in a zsmalloc object */
 	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
-} __attribute__((aligned(4)));
+	unsigned long flags;
+};
+
+/*
+ * Compression workspace. Each device has one per CPU online at init
+ * time, so that as many pages can be compressed in parallel.
+ */
+struct zram_stream {
+	struct list_head list;
+	struct crypto_comp *tfm;
+	void *buffer;
+};
 
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
@@ -92,20 +133,43 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	u64 discard;		/* no. of pages freed by discard requests */
+	u64 compr_calls;	/* no. of pages run through the compressor */
+	u64 compr_bytes;	/* their total size once compressed */
+	u64 compr_ns;		/* time spent compressing them */
+	u64 decompr_calls;	/* no. of pages decompressed */
+	u64 decompr_ns;		/* time spent decompressing them */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_same;	/* no. of other single pattern pages */
+	atomic_t pages_dup;	/* no. of pages stored as a reference */
+	atomic_t pages_wb;	/* no. of pages on the backing device */
+	u64 bd_reads;		/* no. of pages read from backing device */
+	u64 bd_writes;		/* no. of pages written back */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	/* Idle compression streams; writers sleep on stream_wait for one */
+	struct list_head streams;
+	spinlock_t stream_lock;
+	wait_queue_head_t stream_wait;
+	/* Compressed objects by checksum, if dedup is enabled */
+	struct hlist_head *dedup_hash;
+	spinlock_t dedup_lock;
+	int dedup;
+	/*
+	 * Optional backing device that idle or incompressible pages can
+	 * be written back to, one page per block. Set before init.
+	 */
+	struct block_device *bdev;
+	char *backing_dev;	/* its path */
+	unsigned long *bitmap;	/* blocks in use */
+	unsigned long nr_blocks;
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -116,6 +180,8 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/* crypto API compressor, can only be changed before init */
+	char compressor[CRYPTO_MAX_ALG_NAME];
 
 	struct zram_stats stats;
 };
@@ -129,4 +195,14 @@ extern struct attribute_group zram_disk_attr_group;
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
 
+/* Which pages zram_writeback() writes back */
+enum zram_wb_mode {
+	ZRAM_WB_HUGE,	/* incompressible pages */
+	ZRAM_WB_IDLE,	/* pages marked idle and not accessed since */
+};
+
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
+
 #endif
@@ -0,0 +1,671 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Objects are grouped in size classes ZS_SIZE_CLASS_DELTA bytes apart,
+ * each class packing its objects back to back into zspages of one to
+ * ZS_MAX_PAGES_PER_ZSPAGE pages, whichever wastes the least space.
+ * Users only get a handle to their object, so that compaction can move
+ * objects out of sparsely used zspages and give whole pages back.
+ */
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+/* Handles of all pools, created with the first pool */
+static struct kmem_cache *zs_handle_cachep;
+static int zs_handle_users;
+static DEFINE_MUTEX(zs_handle_mutex);
+
+static struct zs_handle *to_handle(unsigned long handle)
+{
+	return (struct zs_handle *)handle;
+}
+
+static struct size_class *handle_class(struct zs_pool *pool,
+			struct zs_handle *h)
+{
+	return &pool->classes[h->class];
+}
+
+static int size_to_class(size_t size)
+{
+	if (size <= ZS_MIN_ALLOC_SIZE)
+		return 0;
+
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/*
+ * Number of pages per zspage that makes the best use of them for
+ * objects of the given size.
+ */
+static int get_pages_per_zspage(int size)
+{
+	int i, best = 1, max_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		int zspage_size = i * PAGE_SIZE;
+		int usedpc;
+
+		usedpc = (zspage_size - zspage_size % size) * 100 / zspage_size;
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Copies 'len' bytes from or to offset 'off' of the zspage, which may
+ * cross a page boundary. Called with the class locked.
+ */
+static void zspage_copy(struct zspage *zspage, unsigned long off,
+			void *buf, size_t len, int write)
+{
+	while (len) {
+		unsigned long page_off = off & ~PAGE_MASK;
+		size_t n = min_t(size_t, len, PAGE_SIZE - page_off);
+		void *addr;
+
+		addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], KM_USER1);
+		if (write)
+			memcpy(addr + page_off, buf, n);
+		else
+			memcpy(buf, addr + page_off, n);
+		kunmap_atomic(addr, KM_USER1);
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+}
+
+static unsigned long obj_get_word(struct size_class *class,
+			struct zspage *zspage, int idx)
+{
+	unsigned long off = idx * class->size;
+	unsigned long word, *addr;
+
+	addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], KM_USER1);
+	word = *(unsigned long *)((void *)addr + (off & ~PAGE_MASK));
+	kunmap_atomic(addr, KM_USER1);
+
+	return word;
+}
+
+static void obj_set_word(struct size_class *class,
+			struct zspage *zspage, int idx, unsigned long word)
+{
+	unsigned long off = idx * class->size;
+	unsigned long *addr;
+
+	addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], KM_USER1);
+	*(unsigned long *)((void *)addr + (off & ~PAGE_MASK)) = word;
+	kunmap_atomic(addr, KM_USER1);
+}
+
+static void free_zspage(struct zs_pool *pool, struct size_class *class,
+			struct zspage *zspage)
+{
+	int i;
+
+	for (i = 0; i < class->pages_per_zspage; i++)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+
+	atomic_long_sub(class->pages_per_zspage, &pool->pages);
+}
+
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+			struct size_class *class, gfp_t flags)
+{
+	struct zspage *zspage;
+	int i;
+
+	zspage = kzalloc(sizeof(*zspage), flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(flags);
+		if (!zspage->pages[i])
+			goto fail;
+	}
+	atomic_long_add(class->pages_per_zspage, &pool->pages);
+
+	/* Chain all objects in the free list */
+	for (i = 0; i < class->objs_per_zspage; i++) {
+		unsigned long next = i + 1;
+
+		if (next == class->objs_per_zspage)
+			next = ZS_NO_OBJ;
+		obj_set_word(class, zspage, i, next << 1);
+	}
+	zspage->freeobj = 0;
+
+	return zspage;
+
+fail:
+	while (i--)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+	return NULL;
+}
+
+/* Takes the first free object of a zspage in the partial list */
+static int obj_take(struct size_class *class, struct zspage *zspage,
+			struct zs_handle *h)
+{
+	int idx = zspage->freeobj;
+
+	zspage->freeobj = obj_get_word(class, zspage, idx) >> 1;
+	obj_set_word(class, zspage, idx, (unsigned long)h | OBJ_ALLOCATED);
+
+	zspage->inuse++;
+	class->objs_used++;
+	if (zspage->freeobj == ZS_NO_OBJ && !zspage->isolated)
+		list_move(&zspage->list, &class->full);
+
+	return idx;
+}
+
+/*
+ * Returns 1 if that was the last object of the zspage, which is then
+ * off the class lists and must be freed. An isolated zspage is left to
+ * compaction to free.
+ */
+static int obj_put(struct size_class *class, struct zspage *zspage, int idx)
+{
+	obj_set_word(class, zspage, idx, (unsigned long)zspage->freeobj << 1);
+	zspage->freeobj = idx;
+
+	class->objs_used--;
+	if (zspage->isolated) {
+		zspage->inuse--;
+		return 0;
+	}
+	if (zspage->inuse-- == class->objs_per_zspage)
+		list_move(&zspage->list, &class->partial);
+
+	if (zspage->inuse)
+		return 0;
+
+	list_del(&zspage->list);
+	class->zspages--;
+	return 1;
+}
+
+/**
+ * zs_malloc - Allocate an object of the given size
+ * @pool: pool to allocate from
+ * @size: size of the object, at most ZS_MAX_OBJ_SIZE
+ * @flags: flags for the pages backing the pool, may include __GFP_HIGHMEM
+ *
+ * Returns a handle to the object, to be used with zs_read()/zs_write(),
+ * or 0 on failure.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	struct size_class *class;
+	struct zspage *zspage;
+	struct zs_handle *h;
+
+	if (unlikely(!size || size > ZS_MAX_OBJ_SIZE))
+		return 0;
+
+	h = kmem_cache_alloc(zs_handle_cachep, flags & ~__GFP_HIGHMEM);
+	if (!h)
+		return 0;
+	h->class = size_to_class(size + ZS_HEADER_SIZE);
+	class = handle_class(pool, h);
+
+	spin_lock(&class->lock);
+	if (list_empty(&class->partial)) {
+		spin_unlock(&class->lock);
+
+		zspage = alloc_zspage(pool, class, flags);
+		if (!zspage) {
+			kmem_cache_free(zs_handle_cachep, h);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		list_add(&zspage->list, &class->partial);
+		class->zspages++;
+	}
+
+	zspage = list_first_entry(&class->partial, struct zspage, list);
+	h->idx = obj_take(class, zspage, h);
+	h->zspage = zspage;
+	spin_unlock(&class->lock);
+
+	return (unsigned long)h;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_handle *h = to_handle(handle);
+	struct size_class *class = handle_class(pool, h);
+	struct zspage *zspage;
+	int empty;
+
+	spin_lock(&class->lock);
+	zspage = h->zspage;
+	empty = obj_put(class, zspage, h->idx);
+	spin_unlock(&class->lock);
+
+	if (empty)
+		free_zspage(pool, class, zspage);
+	kmem_cache_free(zs_handle_cachep, h);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+void zs_write(struct zs_pool *pool, unsigned long handle,
+			const void *src, size_t len)
+{
+	struct zs_handle *h = to_handle(handle);
+	struct size_class *class = handle_class(pool, h);
+
+	spin_lock(&class->lock);
+	zspage_copy(h->zspage, h->idx * class->size + ZS_HEADER_SIZE,
+			(void *)src, len, 1);
+	spin_unlock(&class->lock);
+}
+EXPORT_SYMBOL_GPL(zs_write);
+
+void zs_read(struct zs_pool *pool, unsigned long handle,
+			void *dst, size_t len)
+{
+	struct zs_handle *h = to_handle(handle);
+	struct size_class *class = handle_class(pool, h);
+
+	spin_lock(&class->lock);
+	zspage_copy(h->zspage, h->idx * class->size + ZS_HEADER_SIZE,
+			dst, len, 0);
+	spin_unlock(&class->lock);
+}
+EXPORT_SYMBOL_GPL(zs_read);
+
+/* memcmp() of the first 'len' bytes of an object against 'buf' */
+int zs_compare(struct zs_pool *pool, unsigned long handle,
+			const void *buf, size_t len)
+{
+	struct zs_handle *h = to_handle(handle);
+	struct size_class *class = handle_class(pool, h);
+	unsigned long off;
+	int ret = 0;
+
+	spin_lock(&class->lock);
+	off = h->idx * class->size + ZS_HEADER_SIZE;
+	while (len && !ret) {
+		unsigned long page_off = off & ~PAGE_MASK;
+		size_t n = min_t(size_t, len, PAGE_SIZE - page_off);
+		void *addr;
+
+		addr = kmap_atomic(h->zspage->pages[off >> PAGE_SHIFT],
+				KM_USER1);
+		ret = memcmp(addr + page_off, buf, n);
+		kunmap_atomic(addr, KM_USER1);
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+	spin_unlock(&class->lock);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(zs_compare);
+
+/*
+ * Pick the partial zspage with the fewest objects as the one to empty,
+ * provided the other partial zspages have room for all of them.
+ * Called with the class locked.
+ */
+static struct zspage *find_source_zspage(struct size_class *class)
+{
+	struct zspage *zspage, *src = NULL;
+	unsigned long free_objs = 0;
+
+	list_for_each_entry(zspage, &class->partial, list) {
+		free_objs += class->objs_per_zspage - zspage->inuse;
+		if (!src || zspage->inuse < src->inuse)
+			src = zspage;
+	}
+
+	if (!src || free_objs - (class->objs_per_zspage - src->inuse) <
+			src->inuse)
+		return NULL;
+
+	return src;
+}
+
+/* The fullest partial zspage. Called with the class locked */
+static struct zspage *find_target_zspage(struct size_class *class)
+{
+	struct zspage *zspage, *dst = NULL;
+
+	list_for_each_entry(zspage, &class->partial, list) {
+		if (!dst || zspage->inuse > dst->inuse)
+			dst = zspage;
+	}
+
+	return dst;
+}
+
+/* Called with the class locked */
+static void isolate_zspage(struct zspage *zspage)
+{
+	list_del_init(&zspage->list);
+	zspage->isolated = true;
+}
+
+/*
+ * Gives an isolated zspage back to its class. Returns 1 if it has no
+ * objects left, in which case it is dropped instead and must be freed.
+ * Called with the class locked.
+ */
+static int putback_zspage(struct size_class *class, struct zspage *zspage)
+{
+	zspage->isolated = false;
+	if (!zspage->inuse) {
+		class->zspages--;
+		return 1;
+	}
+
+	if (zspage->freeobj == ZS_NO_OBJ)
+		list_add(&zspage->list, &class->full);
+	else
+		list_add(&zspage->list, &class->partial);
+	return 0;
+}
+
+/* Moves object 'idx' of 'src' to 'dst'. Called with the class locked */
+static void move_object(struct zs_pool *pool, struct size_class *class,
+			struct zspage *src, struct zspage *dst, int idx,
+			struct zs_handle *h)
+{
+	zspage_copy(src, idx * class->size, pool->compact_buf,
+			class->size, 0);
+	h->idx = obj_take(class, dst, h);
+	h->zspage = dst;
+	zspage_copy(dst, h->idx * class->size, pool->compact_buf,
+			class->size, 1);
+	obj_put(class, src, idx);
+}
+
+/*
+ * Moves every object of one partial zspage into the others, until no
+ * zspage of the class can be emptied anymore or about 'nr_pages' pages
+ * were freed.
+ *
+ * The zspages being emptied and filled are isolated, so the class lock
+ * is only held for one object at a time: users may allocate and free in
+ * between, which can leave the class with no room to finish emptying a
+ * zspage after all.
+ */
+static unsigned long compact_class(struct zs_pool *pool,
+			struct size_class *class, unsigned long nr_pages)
+{
+	unsigned long freed = 0;
+	struct zspage *src, *dst = NULL;
+	int idx, empty, dst_empty;
+
+	while (freed < nr_pages) {
+		spin_lock(&class->lock);
+		src = find_source_zspage(class);
+		if (!src) {
+			spin_unlock(&class->lock);
+			break;
+		}
+		isolate_zspage(src);
+
+		for (idx = 0; src->inuse && idx < class->objs_per_zspage;
+		     idx++) {
+			unsigned long word;
+
+			if (!dst) {
+				dst = find_target_zspage(class);
+				if (!dst)
+					break;
+				isolate_zspage(dst);
+			}
+
+			word = obj_get_word(class, src, idx);
+			if (!(word & OBJ_ALLOCATED))
+				continue;
+			move_object(pool, class, src, dst, idx,
+				    to_handle(word & ~OBJ_ALLOCATED));
+
+			if (dst->freeobj == ZS_NO_OBJ) {
+				putback_zspage(class, dst);
+				dst = NULL;
+			}
+
+			spin_unlock(&class->lock);
+			cond_resched();
+			spin_lock(&class->lock);
+		}
+
+		empty = putback_zspage(class, src);
+		dst_empty = dst && putback_zspage(class, dst);
+		spin_unlock(&class->lock);
+
+		/* users may have freed everything we moved meanwhile */
+		if (dst_empty) {
+			free_zspage(pool, class, dst);
+			freed += class->pages_per_zspage;
+		}
+		dst = NULL;
+
+		if (!empty)
+			break;
+		free_zspage(pool, class, src);
+		freed += class->pages_per_zspage;
+	}
+
+	return freed;
+}
+
+static unsigned long __zs_compact(struct zs_pool *pool, unsigned long nr_pages)
+{
+	unsigned long freed = 0;
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES && freed < nr_pages; i++)
+		freed += compact_class(pool, &pool->classes[i],
+				       nr_pages - freed);
+	atomic_long_add(freed, &pool->pages_compacted);
+
+	return freed;
+}
+
+/**
+ * zs_compact - Move objects around to free as many pages as possible
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	unsigned long freed;
+
+	mutex_lock(&pool->compact_lock);
+	freed = __zs_compact(pool, ULONG_MAX);
+	mutex_unlock(&pool->compact_lock);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+/* Rough number of pages compaction could free right now */
+static unsigned long zs_compactable_pages(struct zs_pool *pool)
+{
+	unsigned long pages = 0;
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+		unsigned long free_objs = 0;
+		struct zspage *zspage;
+
+		spin_lock(&class->lock);
+		list_for_each_entry(zspage, &class->partial, list)
+			free_objs += class->objs_per_zspage - zspage->inuse;
+		spin_unlock(&class->lock);
+
+		pages += free_objs / class->objs_per_zspage *
+				class->pages_per_zspage;
+	}
+
+	return pages;
+}
+
+static int zs_shrink(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+						shrinker);
+
+	if (sc->nr_to_scan) {
+		if (!mutex_trylock(&pool->compact_lock))
+			return -1;
+		__zs_compact(pool, sc->nr_to_scan);
+		mutex_unlock(&pool->compact_lock);
+	}
+
+	return min_t(unsigned long, zs_compactable_pages(pool), INT_MAX);
+}
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+void zs_get_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	int i;
+
+	stats->pages = atomic_long_read(&pool->pages);
+	stats->pages_compacted = atomic_long_read(&pool->pages_compacted);
+	stats->obj_bytes = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		spin_lock(&class->lock);
+		stats->obj_bytes += (u64)class->objs_used * class->size;
+		spin_unlock(&class->lock);
+	}
+}
+EXPORT_SYMBOL_GPL(zs_get_stats);
+
+struct zs_pool *zs_create_pool(const char *name)
+{
+	struct zs_pool *pool;
+	int i;
+
+	pool = vzalloc(sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->compact_buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+	if (!pool->compact_buf)
+		goto fail;
+
+	mutex_lock(&zs_handle_mutex);
+	if (!zs_handle_users) {
+		zs_handle_cachep = KMEM_CACHE(zs_handle, 0);
+		if (!zs_handle_cachep) {
+			mutex_unlock(&zs_handle_mutex);
+			goto fail;
+		}
+	}
+	zs_handle_users++;
+	mutex_unlock(&zs_handle_mutex);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		spin_lock_init(&class->lock);
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+					PAGE_SIZE / class->size;
+	}
+
+	atomic_long_set(&pool->pages, 0);
+	atomic_long_set(&pool->pages_compacted, 0);
+	mutex_init(&pool->compact_lock);
+	pool->name = name;
+
+	pool->shrinker.shrink = zs_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	return pool;
+
+fail:
+	kfree(pool->compact_buf);
+	vfree(pool);
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	unregister_shrinker(&pool->shrinker);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+		struct zspage *zspage, *next;
+
+		if (class->zspages)
+			pr_info("%s: class %d freed with %lu objects in use\n",
+				pool->name, class->size, class->objs_used);
+
+		list_for_each_entry_safe(zspage, next, &class->partial, list)
+			free_zspage(pool, class, zspage);
+		list_for_each_entry_safe(zspage, next, &class->full, list)
+			free_zspage(pool, class, zspage);
+	}
+
+	mutex_lock(&zs_handle_mutex);
+	if (!--zs_handle_users)
+		kmem_cache_destroy(zs_handle_cachep);
+	mutex_unlock(&zs_handle_mutex);
+
+	kfree(pool->compact_buf);
+	vfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
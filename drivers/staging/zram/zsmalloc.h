@@ -0,0 +1,45 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_H_
+#define _ZS_MALLOC_H_
+
+#include <linux/types.h>
+
+/* Largest object zs_malloc() can allocate */
+#define ZS_MAX_OBJ_SIZE		(PAGE_SIZE - sizeof(unsigned long))
+
+struct zs_pool;
+
+struct zs_pool_stats {
+	u64 pages;		/* pages backing the pool */
+	u64 obj_bytes;		/* space taken by allocated objects */
+	u64 pages_compacted;	/* pages freed by compaction so far */
+};
+
+struct zs_pool *zs_create_pool(const char *name);
+void zs_destroy_pool(struct zs_pool *pool);
+
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags);
+void zs_free(struct zs_pool *pool, unsigned long handle);
+
+void zs_write(struct zs_pool *pool, unsigned long handle,
+			const void *src, size_t len);
+void zs_read(struct zs_pool *pool, unsigned long handle,
+			void *dst, size_t len);
+int zs_compare(struct zs_pool *pool, unsigned long handle,
+			const void *buf, size_t len);
+
+unsigned long zs_compact(struct zs_pool *pool);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool);
+void zs_get_stats(struct zs_pool *pool, struct zs_pool_stats *stats);
+
+#endif
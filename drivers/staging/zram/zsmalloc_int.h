@@ -0,0 +1,102 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+
+/* User configurable params */
+
+/* Each object starts with a header word, see below */
+#define ZS_HEADER_SIZE		sizeof(unsigned long)
+
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/*
+ * Size classes are ZS_SIZE_CLASS_DELTA bytes apart: 16 bytes for 4k
+ * pages. This must be a multiple of ZS_HEADER_SIZE so that headers
+ * never straddle two pages.
+ */
+#define ZS_SIZE_CLASS_DELTA	(PAGE_SIZE >> 8)
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+					/ ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * A zspage is the group of (not necessarily contiguous) pages objects
+ * of a class are carved from. Objects may straddle two of its pages,
+ * which is why they are only accessed through zs_read()/zs_write().
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/* End of user params */
+
+#define ZS_NO_OBJ		0xffff
+
+/*
+ * The header word of an object holds its handle, tagged with
+ * OBJ_ALLOCATED, which compaction uses to find and update the handle
+ * of an object it moves. A free object holds the index of the next
+ * free object of its zspage, shifted left by one.
+ */
+#define OBJ_ALLOCATED		1UL
+
+/*
+ * What a handle points to. The object may be moved by compaction, but
+ * never changes class, so the class lock is what protects zspage/idx.
+ */
+struct zs_handle {
+	struct zspage *zspage;
+	u16 idx;
+	u16 class;
+};
+
+/*
+ * While compaction moves objects out of or into a zspage, the zspage is
+ * isolated: off its class lists, so that zs_malloc() does not pick it
+ * and zs_free() does not free it.
+ */
+struct zspage {
+	struct list_head list;	/* in its class' partial or full list */
+	u16 inuse;		/* no. of allocated objects */
+	u16 freeobj;		/* first free object, or ZS_NO_OBJ */
+	bool isolated;		/* held by compaction */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+};
+
+struct size_class {
+	spinlock_t lock;
+	struct list_head partial;	/* zspages with free objects */
+	struct list_head full;
+	u16 size;
+	u16 pages_per_zspage;
+	u16 objs_per_zspage;
+	unsigned long zspages;
+	unsigned long objs_used;
+};
+
+struct zs_pool {
+	struct size_class classes[ZS_SIZE_CLASSES];
+	atomic_long_t pages;		/* stats */
+	atomic_long_t pages_compacted;
+	/* Serializes compaction, which moves objects through compact_buf */
+	struct mutex compact_lock;
+	void *compact_buf;
+	struct shrinker shrinker;
+	const char *name;
+};
+
+#endif
@@ -969,6 +969,9 @@ static int de_thread(struct task_struct *tsk)
 		write_unlock_irq(&tasklist_lock);
 
 		release_task(leader);
+
+		/* let whoever tracks processes by leader know of the change */
+		oom_adj_changed(tsk);
 	}
 
 	sig->group_exit_task = NULL;
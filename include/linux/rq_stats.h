@@ -29,3 +29,9 @@ struct rq_data {
 extern spinlock_t rq_lock;
 extern struct rq_data rq_info;
 extern struct workqueue_struct *rq_wq;
+
+/*
+ * Returns the run queue average, in tenths of a task, since the previous
+ * call and starts a new averaging period.
+ */
+unsigned int msm_rq_stats_read_avg(void);
@@ -991,6 +991,11 @@ struct sched_domain {
 	unsigned int ttwu_wake_remote;
 	unsigned int ttwu_move_affine;
 	unsigned int ttwu_move_balance;
+
+	/* select_task_rq_fair() small SMP fast path stats */
+	unsigned int sfp_count;
+	unsigned int sfp_prev;
+	unsigned int sfp_idle;
 #endif
 #ifdef CONFIG_SCHED_DEBUG
 	char *name;
@@ -39,6 +39,9 @@ struct seq_file;
  *			  1 if b will signal before a
  *			  0 if a and b will signal at the same time
  *			 -1 if a will signabl before b
+ *			active sync_pts are kept in this order, and a
+ *			timeline signal stops at the first one that has
+ *			not signaled
  * @free_pt:		called before sync_pt is freed
  * @release_obj:	called before sync_timeline is freed
  * @print_obj:		deprecated
@@ -95,8 +98,14 @@ struct sync_timeline_ops {
  * @child_list_head:	list of children sync_pts for this sync_timeline
  * @child_list_lock:	lock protecting @child_list_head, destroyed, and
  *			  sync_pt.status
- * @active_list_head:	list of active (unsignaled/errored) sync_pts
+ * @active_list_head:	list of active (unsignaled/errored) sync_pts, in
+ *			  the order they will signal
  * @sync_timeline_list:	membership in global sync_timeline_list
+ * @signal_count:	number of sync_timeline_signal() calls that found
+ *			  active sync_pts
+ * @signaled_pts:	number of sync_pts signaled by those calls
+ * @signal_ns_total:	time spent in those calls, including callbacks
+ * @signal_ns_max:	longest of those calls
  */
 struct sync_timeline {
 	struct kref		kref;
@@ -113,6 +122,12 @@ struct sync_timeline {
 	spinlock_t		active_list_lock;
 
 	struct list_head	sync_timeline_list;
+
+	/* statistics, updated without locking */
+	unsigned long		signal_count;
+	unsigned long		signaled_pts;
+	u64			signal_ns_total;
+	u64			signal_ns_max;
 };
 
 /**
@@ -0,0 +1,40 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rq_hotplug
+
+#if !defined(_TRACE_RQ_HOTPLUG_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_RQ_HOTPLUG_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(rq_hotplug_decision,
+	    TP_PROTO(unsigned int rq_avg, unsigned int load, unsigned int freq,
+		     unsigned int online, int action),
+
+	    TP_ARGS(rq_avg, load, freq, online, action),
+
+	    TP_STRUCT__entry(
+		    __field(unsigned int, rq_avg)
+		    __field(unsigned int, load)
+		    __field(unsigned int, freq)
+		    __field(unsigned int, online)
+		    __field(int, action)
+		    ),
+
+	    TP_fast_assign(
+		    __entry->rq_avg = rq_avg;
+		    __entry->load = load;
+		    __entry->freq = freq;
+		    __entry->online = online;
+		    __entry->action = action;
+		    ),
+
+	    TP_printk("rq_avg=%u.%u load=%u freq=%u online=%u action=%d",
+		      __entry->rq_avg / 10, __entry->rq_avg % 10,
+		      __entry->load, __entry->freq, __entry->online,
+		      __entry->action)
+);
+
+#endif /* _TRACE_RQ_HOTPLUG_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -1675,6 +1675,66 @@ static int select_idle_sibling(struct task_struct *p, int target)
 	return target;
 }
 
+/*
+ * Biggest domain select_small_smp() handles.
+ */
+#define SMALL_SMP_CPUS	4
+
+/*
+ * Fast path for small SMP systems whose cpus all share their last level
+ * cache: moving a task between them loses no cache, so the affine and
+ * idlest group logic below buys nothing over just taking an idle cpu.
+ * Returns the previous cpu if it is idle, else an idle cpu of the domain
+ * (this cpu first), or -1 when they are all busy and the load has to be
+ * weighed after all.
+ *
+ * Without a cache level in the topology (e.g. ARM without SCHED_MC) the
+ * cpus end up in a single domain; on the few core parts using this path
+ * that is a cluster behind a shared L2, so a lone domain counts as one.
+ *
+ * Must be called under rcu_read_lock().
+ */
+static int select_small_smp(struct task_struct *p, int cpu, int prev_cpu)
+{
+	struct sched_domain *tmp, *sd = NULL;
+	int i;
+
+	for_each_domain(cpu, tmp) {
+		if (tmp->flags & SD_LOAD_BALANCE)
+			sd = tmp;
+	}
+
+	if (!sd || sd->span_weight > SMALL_SMP_CPUS ||
+	    (sd->flags & SD_POWERSAVINGS_BALANCE))
+		return -1;
+	if (!(sd->flags & SD_SHARE_PKG_RESOURCES) && sd->child)
+		return -1;
+	if (!cpumask_test_cpu(prev_cpu, sched_domain_span(sd)))
+		return -1;
+
+	schedstat_inc(sd, sfp_count);
+
+	if (idle_cpu(prev_cpu) &&
+	    cpumask_test_cpu(prev_cpu, &p->cpus_allowed)) {
+		schedstat_inc(sd, sfp_prev);
+		return prev_cpu;
+	}
+
+	if (idle_cpu(cpu) && cpumask_test_cpu(cpu, &p->cpus_allowed)) {
+		schedstat_inc(sd, sfp_idle);
+		return cpu;
+	}
+
+	for_each_cpu_and(i, sched_domain_span(sd), &p->cpus_allowed) {
+		if (idle_cpu(i)) {
+			schedstat_inc(sd, sfp_idle);
+			return i;
+		}
+	}
+
+	return -1;
+}
+
 /*
  * sched_balance_self: balance the current task (running on cpu) in domains
  * that have the 'flag' flag set. In practice, this is SD_BALANCE_FORK and
@@ -1704,6 +1764,15 @@ select_task_rq_fair(struct task_struct *p, int sd_flag, int wake_flags)
 	}
 
 	rcu_read_lock();
+	if (sched_feat(SMALL_SMP)) {
+		int small_cpu = select_small_smp(p, cpu, prev_cpu);
+
+		if (small_cpu >= 0) {
+			new_cpu = small_cpu;
+			goto unlock;
+		}
+	}
+
 	for_each_domain(cpu, tmp) {
 		if (!(tmp->flags & SD_LOAD_BALANCE))
 			continue;
@@ -24,6 +24,13 @@ SCHED_FEAT(WAKEUP_PREEMPT, 1)
  */
 SCHED_FEAT(AFFINE_WAKEUPS, 1)
 
+/*
+ * On small SMP systems sharing their last level cache, place waking,
+ * forked and exec'ed tasks on their previous cpu or any idle one without
+ * walking the domains, see select_small_smp().
+ */
+SCHED_FEAT(SMALL_SMP, 1)
+
 /*
  * Prefer to schedule the task we woke last (assuming it failed
  * wakeup-preemption), since its likely going to consume data we
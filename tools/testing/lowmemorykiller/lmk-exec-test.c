@@ -0,0 +1,105 @@
+/* $(CROSS_COMPILE)cc -Wall -O2 -o lmk-exec-test lmk-exec-test.c -lpthread */
+
+/*
+ * Checks that a process stays in the lowmemorykiller task index when a
+ * thread other than its leader calls exec and takes over as leader.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INDEX_MISSING "/sys/module/lowmemorykiller/parameters/index_missing"
+
+static char *self;
+
+/*
+ * Is this process listed in index_missing? Other processes may show up there
+ * for a moment while they fork, so only our own pid counts.
+ */
+static int self_missing(void)
+{
+	FILE *f = fopen(INDEX_MISSING, "r");
+	int pid, self_pid = getpid(), missing = 0;
+
+	if (!f) {
+		perror(INDEX_MISSING);
+		exit(2);
+	}
+	while (fscanf(f, "%d", &pid) == 1)
+		if (pid == self_pid)
+			missing = 1;
+	if (ferror(f)) {
+		perror(INDEX_MISSING);
+		exit(2);
+	}
+	fclose(f);
+	return missing;
+}
+
+static int set_oom_adj(int adj)
+{
+	FILE *f = fopen("/proc/self/oom_adj", "w");
+
+	if (!f)
+		return -1;
+	fprintf(f, "%d\n", adj);
+	return fclose(f);
+}
+
+static void *exec_thread(void *arg)
+{
+	execl(self, self, "--after-exec", (char *)NULL);
+	perror("execl");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t thread;
+
+	if (argc > 1 && !strcmp(argv[1], "--after-exec")) {
+		/* we are now the leader, under the same pid; find us filed */
+		if (self_missing()) {
+			printf("FAIL: %d missing from the index after exec\n",
+			       getpid());
+			return 1;
+		}
+		if (set_oom_adj(15)) {
+			perror("oom_adj");
+			return 2;
+		}
+		if (self_missing()) {
+			printf("FAIL: %d missing from the index after oom_adj "
+			       "write\n", getpid());
+			return 1;
+		}
+		printf("PASS\n");
+		return 0;
+	}
+
+	self = "/proc/self/exe";
+	if (self_missing()) {
+		printf("SKIP: %d already missing from the index\n", getpid());
+		return 2;
+	}
+
+	/* exec from a thread that is not the group leader */
+	if (pthread_create(&thread, NULL, exec_thread, NULL)) {
+		perror("pthread_create");
+		return 2;
+	}
+	for (;;)
+		pause();
+}